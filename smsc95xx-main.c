@@ -18,6 +18,14 @@
 #include <linux/usb/usbnet.h>
 #include <linux/slab.h>
 #include <linux/of_net.h>
+#include <linux/prefetch.h>
+#include <linux/kthread.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/udp.h>
+#include <linux/pkt_sched.h>
+#include <linux/jhash.h>
+#include <net/ipv6.h>
 #include "smsc95xx-main.h"
 #include "smsc95xx-priv.h"
 #if defined(NETRW_DRV)
@@ -39,6 +47,37 @@
 #define SMSC95XX_INTERNAL_PHY_ID	(1)
 #define SMSC95XX_TX_OVERHEAD		(8)
 #define SMSC95XX_TX_OVERHEAD_CSUM	(12)
+#define SMSC95XX_RX_THREAD_BACKLOG	(64)
+#define SMSC95XX_TX_AGG_SIZE		(16 * 1024)
+#define SMSC95XX_TX_AGG_FLUSH_NS	(100 * NSEC_PER_USEC)
+#define SMSC95XX_TX_PRIO_LEN		(128)
+#define SMSC95XX_TX_POOL_ORDER		get_order(SMSC95XX_TX_AGG_SIZE)
+/* a TSO skb is packed into a single aggregate: leave room for the
+ * headers copied into each segment, its command words and padding */
+#define SMSC95XX_TX_GSO_MAX_SEGS	(16)
+#define SMSC95XX_TX_GSO_MAX_SIZE	(SKB_WITH_OVERHEAD(SMSC95XX_TX_AGG_SIZE) - \
+					 SMSC95XX_TX_GSO_MAX_SEGS * \
+					 (SMSC95XX_TX_OVERHEAD_CSUM + 3 + 160))
+#define SMSC95XX_TX_ZLP_FILL		(4)
+#define SMSC95XX_POLL_MIN_US		(100)
+#define SMSC95XX_POLL_MAX_US		(10000)
+#define SMSC95XX_POLL_TIMEOUT_MS	(1000)
+
+/* private tx state kept in skb->cb behind usbnet's struct skb_data */
+struct smsc95xx_tx_cb {
+	union {
+		/* stack skb sent as is: its own destructor, chained */
+		void (*destructor)(struct sk_buff *skb);
+		/* aggregate: the frames packed into it, linked by ->next */
+		struct sk_buff *held;
+	};
+};
+
+#define SMSC95XX_TX_CB(skb) \
+	((struct smsc95xx_tx_cb *)((skb)->cb + sizeof(struct skb_data)))
+#define SMSC95XX_RX_HEADROOM		(NET_SKB_PAD + NET_IP_ALIGN)
+#define SMSC95XX_RX_FRAG_SIZE(len)	(SKB_DATA_ALIGN(SMSC95XX_RX_HEADROOM + (len)) + \
+					 SKB_DATA_ALIGN(sizeof(struct skb_shared_info)))
 #define SUPPORTED_WAKE			(WAKE_PHY | WAKE_UCAST | WAKE_BCAST | \
 					 WAKE_MCAST | WAKE_ARP | WAKE_MAGIC)
 
@@ -57,11 +96,85 @@
 #endif
 
 #define CARRIER_CHECK_DELAY (2 * HZ)
+#define RX_TUNE_INTERVAL (HZ / 2)
+#define RX_TUNE_DEFAULT_LEVEL		(2)
+
+/* BULK_IN_DLY steps, from sparse latency-sensitive to heavy bulk traffic */
+static const u32 smsc95xx_bulk_in_dly[] = {
+	0x00000400,		/* ~17us */
+	0x00001000,		/* ~68us */
+	DEFAULT_BULK_IN_DELAY,	/* ~136us */
+	0x00004000,		/* ~273us */
+};
 
 static bool turbo_mode = true;
 module_param(turbo_mode, bool, 0644);
 MODULE_PARM_DESC(turbo_mode, "Enable multiple frames per Rx transaction");
 
+static bool rx_frag_mode = false;
+module_param(rx_frag_mode, bool, 0644);
+MODULE_PARM_DESC(rx_frag_mode, "Build Rx frames in page fragments instead of URB clones");
+
+static int rx_copybreak = 256;
+module_param(rx_copybreak, int, 0644);
+MODULE_PARM_DESC(rx_copybreak, "Copy Rx frames shorter than this into a new skb");
+
+static int rx_pool_depth = 8;
+module_param(rx_pool_depth, int, 0644);
+MODULE_PARM_DESC(rx_pool_depth, "Rx page pool size in bursts of BURST_CAP for rx_frag_mode (0 = off)");
+
+static bool rx_napi = false;
+module_param(rx_napi, bool, 0644);
+MODULE_PARM_DESC(rx_napi, "Deliver Rx frames from a NAPI context through GRO");
+
+static int rx_napi_weight = NAPI_POLL_WEIGHT;
+module_param(rx_napi_weight, int, 0444);
+MODULE_PARM_DESC(rx_napi_weight, "NAPI poll budget (1-64)");
+
+static bool rx_list = false;
+module_param(rx_list, bool, 0644);
+MODULE_PARM_DESC(rx_list, "Deliver all Rx frames of an URB in one netif_receive_skb_list()");
+
+static bool adaptive_rx = false;
+module_param(adaptive_rx, bool, 0644);
+MODULE_PARM_DESC(adaptive_rx, "Retune BULK_IN_DLY and BURST_CAP from Rx traffic");
+
+static bool rx_resync = false;
+module_param(rx_resync, bool, 0644);
+MODULE_PARM_DESC(rx_resync, "Rescan an Rx URB for the next frame after a bad header");
+
+static int rx_thread_cpu = -1;
+module_param(rx_thread_cpu, int, 0444);
+MODULE_PARM_DESC(rx_thread_cpu, "De-aggregate Rx URBs in a kthread pinned to this CPU (-1 = off)");
+
+static bool tx_agg = false;
+module_param(tx_agg, bool, 0644);
+MODULE_PARM_DESC(tx_agg, "Pack multiple Tx frames into one bulk-out transfer");
+
+static int tx_agg_max_frames = 16;
+module_param(tx_agg_max_frames, int, 0644);
+MODULE_PARM_DESC(tx_agg_max_frames, "Maximum Tx frames per bulk-out transfer");
+
+static int tx_agg_hold = 0;
+module_param(tx_agg_hold, int, 0644);
+MODULE_PARM_DESC(tx_agg_hold, "Hold a Tx aggregate this many usecs for more frames");
+
+static int tx_pool_depth = 8;
+module_param(tx_pool_depth, int, 0444);
+MODULE_PARM_DESC(tx_pool_depth, "Tx aggregate buffers preallocated on open when tx_agg is set (0 = off)");
+
+static int tx_prio_reserve = 2;
+module_param(tx_prio_reserve, int, 0644);
+MODULE_PARM_DESC(tx_prio_reserve, "Tx URB slots kept free of bulk data for priority frames (0 = off)");
+
+static bool async_init = true;
+module_param(async_init, bool, 0444);
+MODULE_PARM_DESC(async_init, "Initialize the hardware from a work item after bind");
+
+static bool reg_shadow = true;
+module_param(reg_shadow, bool, 0644);
+MODULE_PARM_DESC(reg_shadow, "Serve configuration register reads from a shadow copy");
+
 #if defined(OPENWRT_PLATFORM)
 static bool truesize_mode = false;
 module_param(truesize_mode, bool, 0644);
@@ -76,23 +189,269 @@ module_param(macaddr, charp, 0);
 MODULE_PARM_DESC(macaddr, "MAC address");
 #endif
 
+/* seeded once in bind, shared by all adapters */
+static u32 smsc95xx_rx_hash_seed __read_mostly;
+
+/* Shadowed registers: bits that clear themselves (resets in progress)
+ * keep a value out of the shadow, status bits are never part of it.
+ */
+static const struct {
+	u32 index;
+	u32 self_clear;
+	u32 status;
+} smsc95xx_shadow_regs[SMSC95XX_SHADOW_NUM] = {
+	[SMSC95XX_SHADOW_HW_CFG]	= { HW_CFG, HW_CFG_LRST_ | HW_CFG_SRST_, 0 },
+	[SMSC95XX_SHADOW_COE_CR]	= { COE_CR, 0, 0 },
+	[SMSC95XX_SHADOW_INT_EP_CTL]	= { INT_EP_CTL, 0, 0 },
+	[SMSC95XX_SHADOW_AFC_CFG]	= { AFC_CFG, 0, 0 },
+	[SMSC95XX_SHADOW_WUCSR]		= { WUCSR, WUCSR_WFF_PTR_RST_,
+					    WUCSR_WUFR_ | WUCSR_MPR_ },
+	[SMSC95XX_SHADOW_PM_CTRL]	= { PM_CTRL, PM_CTL_PHY_RST_,
+					    PM_CTL_DEV_RDY_ | PM_CTL_WUPS_ },
+};
+
+static struct smsc95xx_shadow *smsc95xx_shadow(struct usbnet *dev, u32 index,
+					       int *slot)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+	int i;
+
+	if (!reg_shadow || !pdata)
+		return NULL;
+
+	for (i = 0; i < SMSC95XX_SHADOW_NUM; i++) {
+		if (smsc95xx_shadow_regs[i].index == index) {
+			*slot = i;
+			return &pdata->shadow;
+		}
+	}
+
+	return NULL;
+}
+
+static void smsc95xx_shadow_invalidate(struct usbnet *dev)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+
+	if (pdata)
+		pdata->shadow.valid = 0;
+}
+
+static bool smsc95xx_shadow_get(struct usbnet *dev, u32 index, u32 *data)
+{
+	struct smsc95xx_shadow *shadow;
+	int slot;
+
+	shadow = smsc95xx_shadow(dev, index, &slot);
+	if (!shadow || !test_bit(slot, &shadow->valid))
+		return false;
+
+	*data = READ_ONCE(shadow->val[slot]);
+	((struct smsc95xx_priv *)(dev->data[0]))->stats.reg_shadow_hits++;
+	return true;
+}
+
+/* value just read from the device */
+static void smsc95xx_shadow_fill(struct usbnet *dev, u32 index, u32 data)
+{
+	struct smsc95xx_shadow *shadow;
+	int slot;
+
+	shadow = smsc95xx_shadow(dev, index, &slot);
+	if (!shadow || (data & smsc95xx_shadow_regs[slot].self_clear))
+		return;
+
+	WRITE_ONCE(shadow->val[slot], data & ~smsc95xx_shadow_regs[slot].status);
+	set_bit(slot, &shadow->valid);
+}
+
+/* value just written to the device */
+static void smsc95xx_shadow_write(struct usbnet *dev, u32 index, u32 data)
+{
+	struct smsc95xx_shadow *shadow;
+	int slot;
+
+	shadow = smsc95xx_shadow(dev, index, &slot);
+	if (!shadow)
+		return;
+
+	if (data & smsc95xx_shadow_regs[slot].self_clear) {
+		/* a lite or soft reset takes every other register with it */
+		if (slot == SMSC95XX_SHADOW_HW_CFG)
+			shadow->valid = 0;
+		else
+			clear_bit(slot, &shadow->valid);
+		return;
+	}
+
+	WRITE_ONCE(shadow->val[slot], data & ~smsc95xx_shadow_regs[slot].status);
+	set_bit(slot, &shadow->valid);
+}
+
+/* Control URBs and DMA-safe buffers set up once per device, so register
+ * access doesn't go through the slab for every transfer. An exhausted
+ * pool falls back to the usbnet helpers.
+ */
+static int smsc95xx_ctrl_pool_init(struct smsc95xx_priv *pdata)
+{
+	struct smsc95xx_ctrl *ctrl;
+	int i;
+
+	for (i = 0; i < SMSC95XX_CTRL_POOL_SIZE; i++) {
+		ctrl = &pdata->ctrl[i];
+		ctrl->pdata = pdata;
+		ctrl->slot = i;
+		init_completion(&ctrl->done);
+
+		ctrl->urb = usb_alloc_urb(0, GFP_KERNEL);
+		ctrl->buf = kzalloc(sizeof(*ctrl->buf), GFP_KERNEL);
+		if (!ctrl->urb || !ctrl->buf)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void smsc95xx_ctrl_pool_free(struct smsc95xx_priv *pdata)
+{
+	struct smsc95xx_ctrl *ctrl;
+	int i;
+
+	for (i = 0; i < SMSC95XX_CTRL_POOL_SIZE; i++) {
+		ctrl = &pdata->ctrl[i];
+
+		/* async writes may still be in flight */
+		usb_kill_urb(ctrl->urb);
+		usb_free_urb(ctrl->urb);
+		kfree(ctrl->buf);
+		ctrl->urb = NULL;
+		ctrl->buf = NULL;
+	}
+}
+
+static struct smsc95xx_ctrl *smsc95xx_ctrl_get(struct usbnet *dev)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+	int i;
+
+	if (!pdata || !pdata->ctrl[SMSC95XX_CTRL_POOL_SIZE - 1].buf)
+		return NULL;
+
+	for (i = 0; i < SMSC95XX_CTRL_POOL_SIZE; i++) {
+		if (!test_and_set_bit_lock(i, &pdata->ctrl_busy))
+			return &pdata->ctrl[i];
+	}
+
+	pdata->stats.ctrl_pool_exhausted++;
+	return NULL;
+}
+
+static void smsc95xx_ctrl_put(struct smsc95xx_ctrl *ctrl)
+{
+	clear_bit_unlock(ctrl->slot, &ctrl->pdata->ctrl_busy);
+}
+
+static void smsc95xx_ctrl_fill(struct usbnet *dev, struct smsc95xx_ctrl *ctrl,
+			       u8 cmd, u8 reqtype, u16 index, u32 buf,
+			       usb_complete_t complete)
+{
+	struct smsc95xx_ctrl_buf *cbuf = ctrl->buf;
+	unsigned int pipe;
+
+	pipe = (reqtype & USB_DIR_IN) ? usb_rcvctrlpipe(dev->udev, 0) :
+					usb_sndctrlpipe(dev->udev, 0);
+
+	cbuf->req.bRequestType = reqtype;
+	cbuf->req.bRequest = cmd;
+	cbuf->req.wValue = 0;
+	cbuf->req.wIndex = cpu_to_le16(index);
+	cbuf->req.wLength = cpu_to_le16(sizeof(cbuf->data));
+	cbuf->data = buf;
+
+	usb_fill_control_urb(ctrl->urb, dev->udev, pipe,
+			     (unsigned char *)&cbuf->req, &cbuf->data,
+			     sizeof(cbuf->data), complete, ctrl);
+}
+
+static void smsc95xx_ctrl_complete(struct urb *urb)
+{
+	struct smsc95xx_ctrl *ctrl = urb->context;
+
+	complete(&ctrl->done);
+}
+
+/* synchronous 4 byte transfer on a pool slot, *buf is in device order */
+static int smsc95xx_ctrl_xfer(struct usbnet *dev, struct smsc95xx_ctrl *ctrl,
+			      u8 cmd, u8 reqtype, u16 index, u32 *buf,
+			      int in_pm)
+{
+	int ret;
+
+	if (!in_pm && usb_autopm_get_interface(dev->intf) < 0)
+		return -ENODEV;
+
+	smsc95xx_ctrl_fill(dev, ctrl, cmd, reqtype, index, *buf,
+			   smsc95xx_ctrl_complete);
+	reinit_completion(&ctrl->done);
+
+	ret = usb_submit_urb(ctrl->urb, GFP_NOIO);
+	if (ret < 0)
+		goto out;
+
+	if (!wait_for_completion_timeout(&ctrl->done,
+				msecs_to_jiffies(USB_CTRL_GET_TIMEOUT))) {
+		usb_kill_urb(ctrl->urb);
+		ret = -ETIMEDOUT;
+		goto out;
+	}
+
+	ret = ctrl->urb->status;
+	if (!ret && ctrl->urb->actual_length != sizeof(*buf))
+		ret = -EIO;
+	if (ret < 0)
+		goto out;
+
+	if (reqtype & USB_DIR_IN)
+		*buf = ctrl->buf->data;
+	ret = sizeof(*buf);
+
+out:
+	if (!in_pm)
+		usb_autopm_put_interface(dev->intf);
+	return ret;
+}
+
 static int __must_check __smsc95xx_read_reg(struct usbnet *dev, u32 index,
 					    u32 *data, int in_pm)
 {
+	struct smsc95xx_ctrl *ctrl;
 	u32 buf;
 	int ret;
 	int (*fn)(struct usbnet *, u8, u8, u16, u16, void *, u16);
 
 	BUG_ON(!dev);
 
+	if (smsc95xx_shadow_get(dev, index, data))
+		return sizeof(*data);
+
 	if (!in_pm)
 		fn = usbnet_read_cmd;
 	else
 		fn = usbnet_read_cmd_nopm;
 
-	ret = fn(dev, USB_VENDOR_REQUEST_READ_REGISTER, USB_DIR_IN
-		 | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
-		 0, index, &buf, 4);
+	ctrl = smsc95xx_ctrl_get(dev);
+	if (ctrl) {
+		buf = 0;
+		ret = smsc95xx_ctrl_xfer(dev, ctrl,
+					 USB_VENDOR_REQUEST_READ_REGISTER,
+					 USB_DIR_IN | USB_TYPE_VENDOR |
+					 USB_RECIP_DEVICE, index, &buf, in_pm);
+		smsc95xx_ctrl_put(ctrl);
+	} else {
+		ret = fn(dev, USB_VENDOR_REQUEST_READ_REGISTER, USB_DIR_IN
+			 | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+			 0, index, &buf, 4);
+	}
 	if (unlikely(ret < 0)) {
 		netdev_warn(dev->net, "Failed to read reg index 0x%08x: %d\n",
 			    index, ret);
@@ -101,6 +460,7 @@ static int __must_check __smsc95xx_read_reg(struct usbnet *dev, u32 index,
 
 	le32_to_cpus(&buf);
 	*data = buf;
+	smsc95xx_shadow_fill(dev, index, buf);
 
 	return ret;
 }
@@ -108,6 +468,7 @@ static int __must_check __smsc95xx_read_reg(struct usbnet *dev, u32 index,
 static int __must_check __smsc95xx_write_reg(struct usbnet *dev, u32 index,
 					     u32 data, int in_pm)
 {
+	struct smsc95xx_ctrl *ctrl;
 	u32 buf;
 	int ret;
 	int (*fn)(struct usbnet *, u8, u8, u16, u16, const void *, u16);
@@ -122,12 +483,27 @@ static int __must_check __smsc95xx_write_reg(struct usbnet *dev, u32 index,
 	buf = data;
 	cpu_to_le32s(&buf);
 
-	ret = fn(dev, USB_VENDOR_REQUEST_WRITE_REGISTER, USB_DIR_OUT
-		 | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
-		 0, index, &buf, 4);
-	if (unlikely(ret < 0))
+	ctrl = smsc95xx_ctrl_get(dev);
+	if (ctrl) {
+		ret = smsc95xx_ctrl_xfer(dev, ctrl,
+					 USB_VENDOR_REQUEST_WRITE_REGISTER,
+					 USB_DIR_OUT | USB_TYPE_VENDOR |
+					 USB_RECIP_DEVICE, index, &buf, in_pm);
+		smsc95xx_ctrl_put(ctrl);
+	} else {
+		ret = fn(dev, USB_VENDOR_REQUEST_WRITE_REGISTER, USB_DIR_OUT
+			 | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+			 0, index, &buf, 4);
+	}
+	if (unlikely(ret < 0)) {
 		netdev_warn(dev->net, "Failed to write reg index 0x%08x: %d\n",
 			    index, ret);
+		/* the device may or may not have taken the write */
+		smsc95xx_shadow_invalidate(dev);
+		return ret;
+	}
+
+	smsc95xx_shadow_write(dev, index, data);
 
 	return ret;
 }
@@ -156,6 +532,184 @@ static int __must_check smsc95xx_write_reg(struct usbnet *dev, u32 index,
 	return __smsc95xx_write_reg(dev, index, data, 0);
 }
 
+/* completion state shared by the URBs of one batch */
+struct smsc95xx_reg_wait {
+	atomic_t pending;
+	struct completion done;
+};
+
+struct smsc95xx_reg_xfer {
+	struct usb_ctrlrequest req;
+	struct smsc95xx_reg_wait *wait;
+	int status;
+	/* DMA buffer, alone in its cache line */
+	__le32 buf ____cacheline_aligned;
+};
+
+static void smsc95xx_reg_batch_init(struct smsc95xx_reg_batch *batch,
+				    struct usbnet *dev, int in_pm)
+{
+	batch->dev = dev;
+	batch->in_pm = in_pm;
+	batch->count = 0;
+	batch->error = 0;
+}
+
+static void smsc95xx_reg_batch_add(struct smsc95xx_reg_batch *batch,
+				   u32 index, u32 value, u32 *data)
+{
+	struct smsc95xx_reg_op *op;
+
+	if (WARN_ON_ONCE(batch->count >= SMSC95XX_REG_BATCH_MAX)) {
+		batch->error = -ENOSPC;
+		return;
+	}
+
+	op = &batch->ops[batch->count++];
+	op->index = index;
+	op->value = value;
+	op->data = data;
+}
+
+static void smsc95xx_reg_batch_read(struct smsc95xx_reg_batch *batch,
+				    u32 index, u32 *data)
+{
+	smsc95xx_reg_batch_add(batch, index, 0, data);
+}
+
+static void smsc95xx_reg_batch_write(struct smsc95xx_reg_batch *batch,
+				     u32 index, u32 data)
+{
+	smsc95xx_reg_batch_add(batch, index, data, NULL);
+}
+
+static void smsc95xx_reg_batch_complete(struct urb *urb)
+{
+	struct smsc95xx_reg_xfer *xfer = urb->context;
+
+	xfer->status = urb->status;
+	if (!xfer->status && urb->actual_length != sizeof(xfer->buf))
+		xfer->status = -EIO;
+
+	if (atomic_dec_and_test(&xfer->wait->pending))
+		complete(&xfer->wait->done);
+}
+
+/* Submit every queued access at once; ep0 runs them in order, so a read
+ * queued after a write sees the written value. Waits once for all of
+ * them and returns the first error. Read results are only valid when
+ * this returns 0.
+ */
+static int __must_check smsc95xx_reg_batch_run(struct smsc95xx_reg_batch *batch)
+{
+	struct usbnet *dev = batch->dev;
+	struct smsc95xx_reg_xfer *xfers, *xfer;
+	struct smsc95xx_reg_op *op;
+	struct smsc95xx_reg_wait wait;
+	struct usb_anchor anchor;
+	unsigned int pipe;
+	struct urb *urb;
+	int i, n, ret;
+
+	if (batch->error)
+		return batch->error;
+	if (!batch->count)
+		return 0;
+
+	xfers = kcalloc(batch->count, sizeof(*xfers), GFP_NOIO);
+	if (!xfers)
+		return -ENOMEM;
+
+	if (!batch->in_pm) {
+		ret = usb_autopm_get_interface(dev->intf);
+		if (ret < 0)
+			goto out;
+	}
+
+	init_usb_anchor(&anchor);
+	init_completion(&wait.done);
+	/* held by the submitter until every URB is in flight */
+	atomic_set(&wait.pending, 1);
+
+	ret = 0;
+	for (n = 0; n < batch->count; n++) {
+		op = &batch->ops[n];
+		xfer = &xfers[n];
+
+		urb = usb_alloc_urb(0, GFP_NOIO);
+		if (!urb) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		xfer->req.bRequestType = USB_TYPE_VENDOR | USB_RECIP_DEVICE |
+					 (op->data ? USB_DIR_IN : USB_DIR_OUT);
+		xfer->req.bRequest = op->data ? USB_VENDOR_REQUEST_READ_REGISTER :
+						USB_VENDOR_REQUEST_WRITE_REGISTER;
+		xfer->req.wValue = 0;
+		xfer->req.wIndex = cpu_to_le16(op->index);
+		xfer->req.wLength = cpu_to_le16(sizeof(xfer->buf));
+		xfer->buf = cpu_to_le32(op->value);
+		xfer->wait = &wait;
+
+		pipe = op->data ? usb_rcvctrlpipe(dev->udev, 0) :
+				  usb_sndctrlpipe(dev->udev, 0);
+		usb_fill_control_urb(urb, dev->udev, pipe,
+				     (unsigned char *)&xfer->req, &xfer->buf,
+				     sizeof(xfer->buf),
+				     smsc95xx_reg_batch_complete, xfer);
+
+		usb_anchor_urb(urb, &anchor);
+		atomic_inc(&wait.pending);
+		ret = usb_submit_urb(urb, GFP_NOIO);
+		if (ret < 0) {
+			usb_unanchor_urb(urb);
+			atomic_dec(&wait.pending);
+			usb_free_urb(urb);
+			break;
+		}
+		/* the anchor keeps the URB until it has completed */
+		usb_free_urb(urb);
+	}
+
+	if (!atomic_dec_and_test(&wait.pending) &&
+	    !wait_for_completion_timeout(&wait.done,
+				msecs_to_jiffies(USB_CTRL_GET_TIMEOUT))) {
+		usb_kill_anchored_urbs(&anchor);
+		wait_for_completion(&wait.done);
+		if (!ret)
+			ret = -ETIMEDOUT;
+	}
+
+	for (i = 0; i < n; i++) {
+		op = &batch->ops[i];
+		xfer = &xfers[i];
+
+		if (xfer->status < 0) {
+			netdev_warn(dev->net, "Failed to %s reg index 0x%08x: %d\n",
+				    op->data ? "read" : "write", op->index,
+				    xfer->status);
+			if (!ret)
+				ret = xfer->status;
+		} else if (op->data) {
+			*op->data = le32_to_cpu(xfer->buf);
+			smsc95xx_shadow_fill(dev, op->index, *op->data);
+		} else {
+			smsc95xx_shadow_write(dev, op->index, op->value);
+		}
+	}
+
+	/* accesses that never completed leave the device state unknown */
+	if (ret < 0)
+		smsc95xx_shadow_invalidate(dev);
+
+	if (!batch->in_pm)
+		usb_autopm_put_interface(dev->intf);
+out:
+	kfree(xfers);
+	return ret;
+}
+
 /* Loop until the read is completed with timeout
  * called with phy_mutex held */
 static int __must_check __smsc95xx_phy_wait_not_busy(struct usbnet *dev,
@@ -430,16 +984,42 @@ static int smsc95xx_write_eeprom(struct usbnet *dev, u32 offset, u32 length,
 	return 0;
 }
 
+static void smsc95xx_ctrl_async_complete(struct urb *urb)
+{
+	struct smsc95xx_ctrl *ctrl = urb->context;
+
+	if (urb->status < 0)
+		netdev_warn(ctrl->pdata->dev->net,
+			    "Error write async cmd, sts=%d\n", urb->status);
+	smsc95xx_ctrl_put(ctrl);
+}
+
 static int __must_check smsc95xx_write_reg_async(struct usbnet *dev, u16 index,
 						 u32 data)
 {
 	const u16 size = 4;
+	struct smsc95xx_ctrl *ctrl;
 	u32 buf;
 	int ret;
 
 	buf = data;
 	cpu_to_le32s(&buf);
 
+	ctrl = smsc95xx_ctrl_get(dev);
+	if (ctrl) {
+		smsc95xx_ctrl_fill(dev, ctrl, USB_VENDOR_REQUEST_WRITE_REGISTER,
+				   USB_DIR_OUT | USB_TYPE_VENDOR |
+				   USB_RECIP_DEVICE, index, buf,
+				   smsc95xx_ctrl_async_complete);
+		ret = usb_submit_urb(ctrl->urb, GFP_ATOMIC);
+		if (ret < 0) {
+			smsc95xx_ctrl_put(ctrl);
+			netdev_warn(dev->net, "Error write async cmd, sts=%d\n",
+				    ret);
+		}
+		return ret;
+	}
+
 	ret = usbnet_write_cmd_async(dev, USB_VENDOR_REQUEST_WRITE_REGISTER,
 				     USB_DIR_OUT | USB_TYPE_VENDOR |
 				     USB_RECIP_DEVICE,
@@ -458,6 +1038,16 @@ static unsigned int smsc95xx_hash(char addr[ETH_ALEN])
 	return (ether_crc(ETH_ALEN, addr) >> 26) & 0x3f;
 }
 
+/* Entry points that reach the hardware once the netdev is registered
+ * must not race the reset done by the init work from bind.
+ */
+static void smsc95xx_wait_init(struct usbnet *dev)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+
+	flush_work(&pdata->init_work);
+}
+
 static void smsc95xx_set_multicast(struct net_device *netdev)
 {
 	struct usbnet *dev = netdev_priv(netdev);
@@ -465,6 +1055,14 @@ static void smsc95xx_set_multicast(struct net_device *netdev)
 	unsigned long flags;
 	int ret;
 
+	/* can't sleep here: leave it to the init work to apply */
+	if (READ_ONCE(pdata->init_pending)) {
+		WRITE_ONCE(pdata->rx_mode_pending, true);
+		smp_mb();
+		if (READ_ONCE(pdata->init_pending))
+			return;
+	}
+
 	pdata->hash_hi = 0;
 	pdata->hash_lo = 0;
 
@@ -660,8 +1258,90 @@ static void check_carrier(struct work_struct *work)
 	schedule_delayed_work(&pdata->carrier_check, CARRIER_CHECK_DELAY);
 }
 
+static int smsc95xx_rx_tune_apply(struct usbnet *dev, int level)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+	u32 burst_cap = pdata->burst_cap_max;
+	u32 pkt_size;
+	int ret;
+
+	/* shorter bursts complete sooner when traffic is sparse */
+	if (burst_cap && level < RX_TUNE_DEFAULT_LEVEL)
+		burst_cap = max(burst_cap >> (RX_TUNE_DEFAULT_LEVEL - level),
+				pdata->burst_cap_min);
+
+	ret = smsc95xx_write_reg(dev, BULK_IN_DLY, smsc95xx_bulk_in_dly[level]);
+	if (ret < 0)
+		return ret;
+
+	ret = smsc95xx_write_reg(dev, BURST_CAP, burst_cap);
+	if (ret < 0)
+		return ret;
+
+	netif_dbg(dev, rx_status, dev->net,
+		  "rx tune level %d: BULK_IN_DLY=0x%08x BURST_CAP=%u\n",
+		  level, smsc95xx_bulk_in_dly[level], burst_cap);
+
+	pkt_size = dev->udev->speed == USB_SPEED_HIGH ?
+		HS_USB_PKT_SIZE : FS_USB_PKT_SIZE;
+
+	pdata->rx_tune.level = level;
+	pdata->rx_tune.burst_bytes = burst_cap ? burst_cap * pkt_size :
+						 dev->rx_urb_size;
+	pdata->stats.rx_tune_changes++;
+	pdata->stats.rx_bulk_in_dly = smsc95xx_bulk_in_dly[level];
+	pdata->stats.rx_burst_cap = burst_cap;
+
+	return 0;
+}
+
+static void smsc95xx_rx_tune(struct work_struct *work)
+{
+	struct smsc95xx_priv *pdata = container_of(work, struct smsc95xx_priv,
+						   rx_tune.work.work);
+	struct smsc95xx_rx_tune *tune = &pdata->rx_tune;
+	struct usbnet *dev = pdata->dev;
+	u64 urbs, frames, bytes, fill;
+	u32 gap_us;
+	int level;
+
+	if (pdata->suspend_flags != 0 || !netif_running(dev->net))
+		return;
+
+	urbs = pdata->stats.rx_urbs - tune->urbs;
+	frames = pdata->stats.rx_urb_frames - tune->frames;
+	bytes = pdata->stats.rx_urb_bytes - tune->bytes;
+	tune->urbs += urbs;
+	tune->frames += frames;
+	tune->bytes += bytes;
+
+	level = tune->level;
+
+	if (!urbs) {
+		/* idle: be ready to answer the next packet quickly */
+		level = 0;
+	} else {
+		/* against the burst the current level lets the device send,
+		 * at level 0 that's only a few full-size frames */
+		fill = div64_u64(bytes * 100, urbs * tune->burst_bytes);
+		gap_us = div64_u64(jiffies_to_usecs(RX_TUNE_INTERVAL), urbs);
+
+		if (fill >= 50 || frames >= urbs * 4)
+			level++;
+		else if (frames < urbs * 2 && gap_us > 1000)
+			level--;
+	}
+
+	level = clamp_t(int, level, 0, ARRAY_SIZE(smsc95xx_bulk_in_dly) - 1);
+	if (level != tune->level && smsc95xx_rx_tune_apply(dev, level) < 0)
+		netdev_warn(dev->net, "Failed to retune bulk-in\n");
+
+	if (adaptive_rx)
+		schedule_delayed_work(&tune->work, RX_TUNE_INTERVAL);
+}
+
 /* Enable or disable Tx & Rx checksum offload engines */
-static int smsc95xx_set_features(struct net_device *netdev,
+static int __smsc95xx_set_features(struct net_device *netdev,
 	netdev_features_t features)
 {
 	struct usbnet *dev = netdev_priv(netdev);
@@ -672,7 +1352,7 @@ static int smsc95xx_set_features(struct net_device *netdev,
 	if (ret < 0)
 		return ret;
 
-	if (features & NETIF_F_IP_CSUM)
+	if (features & (NETIF_F_IP_CSUM | NETIF_F_IPV6_CSUM))
 		read_buf |= Tx_COE_EN_;
 	else
 		read_buf &= ~Tx_COE_EN_;
@@ -690,6 +1370,98 @@ static int smsc95xx_set_features(struct net_device *netdev,
 	return 0;
 }
 
+/* reset runs from the init work and calls the version above directly */
+static int smsc95xx_set_features(struct net_device *netdev,
+	netdev_features_t features)
+{
+	smsc95xx_wait_init(netdev_priv(netdev));
+
+	return __smsc95xx_set_features(netdev, features);
+}
+
+struct smsc95xx_stat_desc {
+	char name[ETH_GSTRING_LEN];
+	size_t offset;
+};
+
+#define SMSC95XX_STAT(m) { #m, offsetof(struct smsc95xx_stats, m) }
+
+static const struct smsc95xx_stat_desc smsc95xx_gstrings_stats[] = {
+	SMSC95XX_STAT(rx_pool_hits),
+	SMSC95XX_STAT(rx_pool_misses),
+	SMSC95XX_STAT(rx_pool_high_water),
+	SMSC95XX_STAT(rx_pool_pages),
+	SMSC95XX_STAT(rx_urbs),
+	SMSC95XX_STAT(rx_urb_frames),
+	SMSC95XX_STAT(rx_urb_frames_max),
+	SMSC95XX_STAT(rx_urb_bytes),
+	SMSC95XX_STAT(rx_tune_changes),
+	SMSC95XX_STAT(rx_bulk_in_dly),
+	SMSC95XX_STAT(rx_burst_cap),
+	SMSC95XX_STAT(rx_resyncs),
+	SMSC95XX_STAT(rx_resync_salvaged),
+	SMSC95XX_STAT(rx_bad_headers),
+	SMSC95XX_STAT(rx_thread_drops),
+	SMSC95XX_STAT(tx_agg_urbs),
+	SMSC95XX_STAT(tx_agg_frames),
+	SMSC95XX_STAT(tx_agg_frames_max),
+	SMSC95XX_STAT(tx_linearized),
+	SMSC95XX_STAT(tx_gso_skbs),
+	SMSC95XX_STAT(tx_realloc),
+	SMSC95XX_STAT(tx_prio_frames),
+	SMSC95XX_STAT(tx_bulk_throttled),
+	SMSC95XX_STAT(tx_pool_hits),
+	SMSC95XX_STAT(tx_pool_misses),
+	SMSC95XX_STAT(tx_pool_high_water),
+	SMSC95XX_STAT(tx_alloc_fail),
+	SMSC95XX_STAT(tx_done_batches),
+	SMSC95XX_STAT(tx_done_urbs),
+	SMSC95XX_STAT(tx_zlp_avoided),
+	SMSC95XX_STAT(reg_shadow_hits),
+	SMSC95XX_STAT(reset_lite_us),
+	SMSC95XX_STAT(reset_phy_us),
+	SMSC95XX_STAT(reset_bmcr_us),
+	SMSC95XX_STAT(reset_total_us),
+	SMSC95XX_STAT(ctrl_pool_exhausted),
+};
+
+static int smsc95xx_ethtool_get_sset_count(struct net_device *netdev, int sset)
+{
+	switch (sset) {
+	case ETH_SS_STATS:
+		return ARRAY_SIZE(smsc95xx_gstrings_stats);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void smsc95xx_ethtool_get_strings(struct net_device *netdev, u32 sset,
+					 u8 *data)
+{
+	int i;
+
+	if (sset != ETH_SS_STATS)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(smsc95xx_gstrings_stats); i++)
+		memcpy(data + i * ETH_GSTRING_LEN,
+		       smsc95xx_gstrings_stats[i].name, ETH_GSTRING_LEN);
+}
+
+/* counters are bumped without locking from a single context each and
+ * are word sized, so a snapshot may be slightly stale but never torn */
+static void smsc95xx_ethtool_get_stats(struct net_device *netdev,
+				       struct ethtool_stats *stats, u64 *data)
+{
+	struct usbnet *dev = netdev_priv(netdev);
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(smsc95xx_gstrings_stats); i++)
+		data[i] = *(unsigned long *)((u8 *)&pdata->stats +
+					     smsc95xx_gstrings_stats[i].offset);
+}
+
 static int smsc95xx_ethtool_get_eeprom_len(struct net_device *net)
 {
 	return MAX_EEPROM_SIZE;
@@ -877,7 +1649,14 @@ static int smsc95xx_set_link_ksettings(struct net_device *net,
 	return retval;
 }
 
+static int smsc95xx_ethtool_begin(struct net_device *netdev)
+{
+	smsc95xx_wait_init(netdev_priv(netdev));
+	return 0;
+}
+
 static const struct ethtool_ops smsc95xx_ethtool_ops = {
+	.begin		= smsc95xx_ethtool_begin,
 	.get_link	= usbnet_get_link,
 	.nway_reset	= usbnet_nway_reset,
 	.get_drvinfo	= usbnet_get_drvinfo,
@@ -893,6 +1672,9 @@ static const struct ethtool_ops smsc95xx_ethtool_ops = {
 	.get_link_ksettings	= smsc95xx_get_link_ksettings,
 	.set_link_ksettings	= smsc95xx_set_link_ksettings,
 	.get_ts_info	= ethtool_op_get_ts_info,
+	.get_sset_count	= smsc95xx_ethtool_get_sset_count,
+	.get_strings	= smsc95xx_ethtool_get_strings,
+	.get_ethtool_stats	= smsc95xx_ethtool_get_stats,
 };
 
 static int smsc95xx_ioctl(struct net_device *netdev, struct ifreq *rq, int cmd)
@@ -902,6 +1684,8 @@ static int smsc95xx_ioctl(struct net_device *netdev, struct ifreq *rq, int cmd)
 	if (!netif_running(netdev))
 		return -EINVAL;
 
+	smsc95xx_wait_init(dev);
+
 	return generic_mii_ioctl(&dev->mii, if_mii(rq), cmd, NULL);
 }
 
@@ -1033,28 +1817,193 @@ static int smsc95xx_start_rx_path(struct usbnet *dev, int in_pm)
 	return __smsc95xx_write_reg(dev, MAC_CR, pdata->mac_cr, in_pm);
 }
 
-static int smsc95xx_phy_initialize(struct usbnet *dev)
+static void smsc95xx_pool_free(struct smsc95xx_page_pool *pool)
 {
-	int bmcr, ret, timeout = 0;
+	unsigned int i;
+
+	/* fragments still held by the stack keep their own page reference */
+	for (i = 0; i < pool->count; i++)
+		put_page(pool->pages[i]);
+
+	kfree(pool->pages);
+	pool->pages = NULL;
+	pool->count = 0;
+	pool->next = 0;
+	pool->cur = NULL;
+	pool->offset = 0;
+}
 
-	/* Initialize MII structure */
-	dev->mii.dev = dev->net;
-	dev->mii.mdio_read = smsc95xx_mdio_read;
-	dev->mii.mdio_write = smsc95xx_mdio_write;
-	dev->mii.phy_id_mask = 0x1f;
-	dev->mii.reg_num_mask = 0x1f;
-	dev->mii.phy_id = SMSC95XX_INTERNAL_PHY_ID;
+/* (re)size the Rx page pool to cover rx_pool_depth bursts of burst_size,
+ * only rx_frag_mode carves frames from it. Runs on reset_resume too.
+ */
+static void smsc95xx_rx_pool_init(struct usbnet *dev, u32 burst_size)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+	struct smsc95xx_page_pool *pool = &pdata->rx_pool;
+	unsigned int count, i;
+
+	count = rx_frag_mode && rx_pool_depth > 0 ?
+		DIV_ROUND_UP(burst_size * rx_pool_depth, PAGE_SIZE) : 0;
+	if (count == pool->count)
+		return;
+
+	smsc95xx_pool_free(pool);
+	pdata->stats.rx_pool_pages = 0;
+
+	if (!count)
+		return;
+
+	pool->pages = kcalloc(count, sizeof(struct page *), GFP_NOIO);
+	if (!pool->pages) {
+		netdev_warn(dev->net, "Unable to allocate Rx pool\n");
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		pool->pages[i] = __dev_alloc_page(GFP_NOIO | __GFP_NOWARN);
+		if (!pool->pages[i])
+			break;
+	}
+	pool->count = i;
+	pdata->stats.rx_pool_pages = i;
+
+	netif_dbg(dev, ifup, dev->net, "Rx pool: %u pages\n", pool->count);
+}
+
+/* Tx aggregate buffers, each one compound page big enough for a burst */
+static void smsc95xx_tx_pool_init(struct usbnet *dev)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+	struct smsc95xx_page_pool *pool = &pdata->tx_pool;
+	unsigned int i;
+
+	if (tx_pool_depth <= 0)
+		return;
+
+	pool->pages = kcalloc(tx_pool_depth, sizeof(struct page *), GFP_KERNEL);
+	if (!pool->pages) {
+		netdev_warn(dev->net, "Unable to allocate Tx pool\n");
+		return;
+	}
+
+	for (i = 0; i < tx_pool_depth; i++) {
+		pool->pages[i] = dev_alloc_pages(SMSC95XX_TX_POOL_ORDER);
+		if (!pool->pages[i])
+			break;
+	}
+	pool->count = i;
+
+	netif_dbg(dev, ifup, dev->net, "Tx pool: %u buffers\n", pool->count);
+}
+
+/* returns a pool page nobody but the pool references anymore */
+static struct page *smsc95xx_pool_get_page(struct smsc95xx_page_pool *pool,
+					   unsigned long *high_water)
+{
+	unsigned int i, idx;
+
+	for (i = 0; i < pool->count; i++) {
+		idx = (pool->next + i) % pool->count;
+		if (page_ref_count(pool->pages[idx]) != 1)
+			continue;
+
+		pool->next = (idx + 1) % pool->count;
+		if (i + 1 > *high_water)
+			*high_water = i + 1;
+		return pool->pages[idx];
+	}
+
+	*high_water = pool->count;
+	return NULL;
+}
+
+static void *smsc95xx_pool_alloc_frag(struct smsc95xx_page_pool *pool,
+				      struct smsc95xx_stats *stats,
+				      unsigned int fragsz)
+{
+	void *data;
+
+	if (!pool->count || fragsz > PAGE_SIZE)
+		return NULL;
+
+	if (!pool->cur || pool->offset + fragsz > PAGE_SIZE) {
+		pool->cur = smsc95xx_pool_get_page(pool,
+						   &stats->rx_pool_high_water);
+		pool->offset = 0;
+		if (!pool->cur)
+			return NULL;
+	}
+
+	/* the fragment owns a reference, dropped by skb_free_frag() */
+	page_ref_inc(pool->cur);
+	data = page_address(pool->cur) + pool->offset;
+	pool->offset += fragsz;
+
+	return data;
+}
+
+/* Wait for the bits in mask to clear, as the reset bits do once the
+ * hardware is done. Sleeps start short and double up to
+ * SMSC95XX_POLL_MAX_US, so a fast reset is seen within ~100us instead of
+ * after a full msleep(). The time it took goes to *elapsed_us.
+ */
+static int smsc95xx_poll_clear(struct usbnet *dev,
+			       int (*read)(struct usbnet *dev, u32 arg, u32 *val),
+			       u32 arg, u32 mask, unsigned long *elapsed_us)
+{
+	ktime_t start = ktime_get();
+	ktime_t timeout = ktime_add_ms(start, SMSC95XX_POLL_TIMEOUT_MS);
+	unsigned int delay = SMSC95XX_POLL_MIN_US;
+	u32 val;
+	int ret;
+
+	for (;;) {
+		usleep_range(delay, delay + delay / 2);
+
+		ret = read(dev, arg, &val);
+		if (ret < 0)
+			return ret;
+
+		if (!(val & mask))
+			break;
+
+		if (ktime_after(ktime_get(), timeout))
+			return -ETIMEDOUT;
+
+		delay = min_t(unsigned int, delay * 2, SMSC95XX_POLL_MAX_US);
+	}
+
+	*elapsed_us = ktime_us_delta(ktime_get(), start);
+	return 0;
+}
+
+static int smsc95xx_poll_read_reg(struct usbnet *dev, u32 index, u32 *val)
+{
+	return smsc95xx_read_reg(dev, index, val);
+}
+
+static int smsc95xx_poll_read_phy(struct usbnet *dev, u32 reg, u32 *val)
+{
+	int ret = smsc95xx_mdio_read(dev->net, dev->mii.phy_id, reg);
+
+	if (ret < 0)
+		return ret;
+
+	*val = ret;
+	return 0;
+}
+
+static int smsc95xx_phy_initialize(struct usbnet *dev)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+	int ret;
 
 	/* reset phy and wait for reset to complete */
 	smsc95xx_mdio_write(dev->net, dev->mii.phy_id, MII_BMCR, BMCR_RESET);
 
-	do {
-		msleep(10);
-		bmcr = smsc95xx_mdio_read(dev->net, dev->mii.phy_id, MII_BMCR);
-		timeout++;
-	} while ((bmcr & BMCR_RESET) && (timeout < 100));
-
-	if (timeout >= 100) {
+	ret = smsc95xx_poll_clear(dev, smsc95xx_poll_read_phy, MII_BMCR,
+				  BMCR_RESET, &pdata->stats.reset_bmcr_us);
+	if (ret < 0) {
 		netdev_warn(dev->net, "timeout on PHY Reset");
 		return -EIO;
 	}
@@ -1081,46 +2030,37 @@ static int smsc95xx_phy_initialize(struct usbnet *dev)
 static int smsc95xx_reset(struct usbnet *dev)
 {
 	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
-	u32 read_buf, write_buf, burst_cap;
-	int ret = 0, timeout;
+	u32 hw_cfg_bir, burst_cap_rd, bulk_in_dly_rd, id_rev;
+	u32 read_buf, hw_cfg, burst_cap, pkt_size;
+	struct smsc95xx_reg_batch batch;
+	ktime_t start = ktime_get();
+	int ret = 0;
 
 	netif_dbg(dev, ifup, dev->net, "entering smsc95xx_reset\n");
 
+	smsc95xx_shadow_invalidate(dev);
+
 	ret = smsc95xx_write_reg(dev, HW_CFG, HW_CFG_LRST_);
 	if (ret < 0)
 		return ret;
 
-	timeout = 0;
-	do {
-		msleep(10);
-		ret = smsc95xx_read_reg(dev, HW_CFG, &read_buf);
-		if (ret < 0)
-			return ret;
-		timeout++;
-	} while ((read_buf & HW_CFG_LRST_) && (timeout < 100));
-
-	if (timeout >= 100) {
+	ret = smsc95xx_poll_clear(dev, smsc95xx_poll_read_reg, HW_CFG,
+				  HW_CFG_LRST_, &pdata->stats.reset_lite_us);
+	if (ret == -ETIMEDOUT)
 		netdev_warn(dev->net, "timeout waiting for completion of Lite Reset\n");
+	if (ret < 0)
 		return ret;
-	}
 
 	ret = smsc95xx_write_reg(dev, PM_CTRL, PM_CTL_PHY_RST_);
 	if (ret < 0)
 		return ret;
 
-	timeout = 0;
-	do {
-		msleep(10);
-		ret = smsc95xx_read_reg(dev, PM_CTRL, &read_buf);
-		if (ret < 0)
-			return ret;
-		timeout++;
-	} while ((read_buf & PM_CTL_PHY_RST_) && (timeout < 100));
-
-	if (timeout >= 100) {
+	ret = smsc95xx_poll_clear(dev, smsc95xx_poll_read_reg, PM_CTRL,
+				  PM_CTL_PHY_RST_, &pdata->stats.reset_phy_us);
+	if (ret == -ETIMEDOUT)
 		netdev_warn(dev->net, "timeout waiting for PHY Reset\n");
+	if (ret < 0)
 		return ret;
-	}
 
 	ret = smsc95xx_set_mac_address(dev);
 	if (ret < 0)
@@ -1129,26 +2069,12 @@ static int smsc95xx_reset(struct usbnet *dev)
 	netif_dbg(dev, ifup, dev->net, "MAC Address: %pM\n",
 		  dev->net->dev_addr);
 
-	ret = smsc95xx_read_reg(dev, HW_CFG, &read_buf);
+	ret = smsc95xx_read_reg(dev, HW_CFG, &hw_cfg);
 	if (ret < 0)
 		return ret;
 
 	netif_dbg(dev, ifup, dev->net, "Read Value from HW_CFG : 0x%08x\n",
-		  read_buf);
-
-	read_buf |= HW_CFG_BIR_;
-
-	ret = smsc95xx_write_reg(dev, HW_CFG, read_buf);
-	if (ret < 0)
-		return ret;
-
-	ret = smsc95xx_read_reg(dev, HW_CFG, &read_buf);
-	if (ret < 0)
-		return ret;
-
-	netif_dbg(dev, ifup, dev->net,
-		  "Read Value from HW_CFG after writing HW_CFG_BIR_: 0x%08x\n",
-		  read_buf);
+		  hw_cfg);
 
 #if defined(OPENWRT_PLATFORM)
 	if (!turbo_mode) {
@@ -1177,94 +2103,88 @@ static int smsc95xx_reset(struct usbnet *dev)
 	netif_dbg(dev, ifup, dev->net, "rx_urb_size=%ld\n",
 		  (ulong)dev->rx_urb_size);
 
-	ret = smsc95xx_write_reg(dev, BURST_CAP, burst_cap);
-	if (ret < 0)
-		return ret;
-
-	ret = smsc95xx_read_reg(dev, BURST_CAP, &read_buf);
+	pkt_size = dev->udev->speed == USB_SPEED_HIGH ?
+		HS_USB_PKT_SIZE : FS_USB_PKT_SIZE;
+
+	smsc95xx_rx_pool_init(dev, burst_cap ? burst_cap * pkt_size :
+			      dev->rx_urb_size);
+
+	/* the adaptive controller starts over from the defaults below */
+	pdata->burst_cap_max = burst_cap;
+	pdata->burst_cap_min = min_t(u32, burst_cap,
+				     MAX_SINGLE_PACKET_SIZE / pkt_size);
+	pdata->rx_tune.level = RX_TUNE_DEFAULT_LEVEL;
+	pdata->rx_tune.burst_bytes = burst_cap ? burst_cap * pkt_size :
+						 dev->rx_urb_size;
+	pdata->stats.rx_bulk_in_dly = DEFAULT_BULK_IN_DELAY;
+	pdata->stats.rx_burst_cap = burst_cap;
+
+	/* The rest of bring-up only depends on the HW_CFG value read above,
+	 * so it goes out as two pipelined batches instead of one round trip
+	 * per register. The read-backs are only there for debugging.
+	 */
+	smsc95xx_reg_batch_init(&batch, dev, 0);
+	smsc95xx_reg_batch_write(&batch, HW_CFG, hw_cfg | HW_CFG_BIR_);
+	smsc95xx_reg_batch_read(&batch, HW_CFG, &hw_cfg_bir);
+	smsc95xx_reg_batch_write(&batch, BURST_CAP, burst_cap);
+	smsc95xx_reg_batch_read(&batch, BURST_CAP, &burst_cap_rd);
+	smsc95xx_reg_batch_write(&batch, BULK_IN_DLY, DEFAULT_BULK_IN_DELAY);
+	smsc95xx_reg_batch_read(&batch, BULK_IN_DLY, &bulk_in_dly_rd);
+	smsc95xx_reg_batch_read(&batch, HW_CFG, &hw_cfg);
+	ret = smsc95xx_reg_batch_run(&batch);
 	if (ret < 0)
 		return ret;
 
+	netif_dbg(dev, ifup, dev->net,
+		  "Read Value from HW_CFG after writing HW_CFG_BIR_: 0x%08x\n",
+		  hw_cfg_bir);
 	netif_dbg(dev, ifup, dev->net,
 		  "Read Value from BURST_CAP after writing: 0x%08x\n",
-		  read_buf);
-
-	ret = smsc95xx_write_reg(dev, BULK_IN_DLY, DEFAULT_BULK_IN_DELAY);
-	if (ret < 0)
-		return ret;
-
-	ret = smsc95xx_read_reg(dev, BULK_IN_DLY, &read_buf);
-	if (ret < 0)
-		return ret;
-
+		  burst_cap_rd);
 	netif_dbg(dev, ifup, dev->net,
 		  "Read Value from BULK_IN_DLY after writing: 0x%08x\n",
-		  read_buf);
-
-	ret = smsc95xx_read_reg(dev, HW_CFG, &read_buf);
-	if (ret < 0)
-		return ret;
-
+		  bulk_in_dly_rd);
 	netif_dbg(dev, ifup, dev->net, "Read Value from HW_CFG: 0x%08x\n",
-		  read_buf);
+		  hw_cfg);
 
 	if (turbo_mode)
-		read_buf |= (HW_CFG_MEF_ | HW_CFG_BCE_);
+		hw_cfg |= (HW_CFG_MEF_ | HW_CFG_BCE_);
 
-	read_buf &= ~HW_CFG_RXDOFF_;
+	hw_cfg &= ~HW_CFG_RXDOFF_;
 
 	/* set Rx data offset=2, Make IP header aligns on word boundary. */
-	read_buf |= NET_IP_ALIGN << 9;
+	hw_cfg |= NET_IP_ALIGN << 9;
 
-	ret = smsc95xx_write_reg(dev, HW_CFG, read_buf);
-	if (ret < 0)
-		return ret;
-
-	ret = smsc95xx_read_reg(dev, HW_CFG, &read_buf);
-	if (ret < 0)
-		return ret;
-
-	netif_dbg(dev, ifup, dev->net,
-		  "Read Value from HW_CFG after writing: 0x%08x\n", read_buf);
-
-	ret = smsc95xx_write_reg(dev, INT_STS, INT_STS_CLEAR_ALL_);
-	if (ret < 0)
-		return ret;
-
-	ret = smsc95xx_read_reg(dev, ID_REV, &read_buf);
-	if (ret < 0)
-		return ret;
-	netif_dbg(dev, ifup, dev->net, "ID_REV = 0x%08x\n", read_buf);
+	smsc95xx_reg_batch_init(&batch, dev, 0);
+	smsc95xx_reg_batch_write(&batch, HW_CFG, hw_cfg);
+	smsc95xx_reg_batch_read(&batch, HW_CFG, &hw_cfg);
+	smsc95xx_reg_batch_write(&batch, INT_STS, INT_STS_CLEAR_ALL_);
+	smsc95xx_reg_batch_read(&batch, ID_REV, &id_rev);
 
 	/* Configure GPIO pins as LED outputs */
-	write_buf = LED_GPIO_CFG_SPD_LED | LED_GPIO_CFG_LNK_LED |
-		LED_GPIO_CFG_FDX_LED;
-	ret = smsc95xx_write_reg(dev, LED_GPIO_CFG, write_buf);
-	if (ret < 0)
-		return ret;
+	smsc95xx_reg_batch_write(&batch, LED_GPIO_CFG, LED_GPIO_CFG_SPD_LED |
+				 LED_GPIO_CFG_LNK_LED | LED_GPIO_CFG_FDX_LED);
 
 	/* Init Tx */
-	ret = smsc95xx_write_reg(dev, FLOW, 0);
-	if (ret < 0)
-		return ret;
-
-	ret = smsc95xx_write_reg(dev, AFC_CFG, AFC_CFG_DEFAULT);
-	if (ret < 0)
-		return ret;
+	smsc95xx_reg_batch_write(&batch, FLOW, 0);
+	smsc95xx_reg_batch_write(&batch, AFC_CFG, AFC_CFG_DEFAULT);
 
 	/* Don't need mac_cr_lock during initialisation */
-	ret = smsc95xx_read_reg(dev, MAC_CR, &pdata->mac_cr);
-	if (ret < 0)
-		return ret;
+	smsc95xx_reg_batch_read(&batch, MAC_CR, &pdata->mac_cr);
 
 	/* Init Rx */
 	/* Set Vlan */
-	ret = smsc95xx_write_reg(dev, VLAN1, (u32)ETH_P_8021Q);
+	smsc95xx_reg_batch_write(&batch, VLAN1, (u32)ETH_P_8021Q);
+	ret = smsc95xx_reg_batch_run(&batch);
 	if (ret < 0)
 		return ret;
 
+	netif_dbg(dev, ifup, dev->net,
+		  "Read Value from HW_CFG after writing: 0x%08x\n", hw_cfg);
+	netif_dbg(dev, ifup, dev->net, "ID_REV = 0x%08x\n", id_rev);
+
 	/* Enable or disable checksum offload engines */
-	ret = smsc95xx_set_features(dev->net, dev->net->features);
+	ret = __smsc95xx_set_features(dev->net, dev->net->features);
 	if (ret < 0) {
 		netdev_warn(dev->net, "Failed to set checksum offload features\n");
 		return ret;
@@ -1301,13 +2221,101 @@ static int smsc95xx_reset(struct usbnet *dev)
 		return ret;
 	}
 
-	netif_dbg(dev, ifup, dev->net, "smsc95xx_reset, return 0\n");
+	pdata->stats.reset_total_us = ktime_us_delta(ktime_get(), start);
+
+	netif_dbg(dev, ifup, dev->net,
+		  "smsc95xx_reset, return 0 (lite %lu us, phy %lu us, bmcr %lu us, total %lu us)\n",
+		  pdata->stats.reset_lite_us, pdata->stats.reset_phy_us,
+		  pdata->stats.reset_bmcr_us, pdata->stats.reset_total_us);
+	return 0;
+}
+
+static int smsc95xx_hw_init(struct usbnet *dev);
+
+static int smsc95xx_open(struct net_device *net)
+{
+	struct usbnet *dev = netdev_priv(net);
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+	int ret;
+
+	/* stay down until the init work from bind is through, and give
+	 * it another go if it failed */
+	flush_work(&pdata->init_work);
+	if (pdata->init_ret < 0) {
+		pdata->init_ret = smsc95xx_hw_init(dev);
+		if (pdata->init_ret < 0)
+			return pdata->init_ret;
+	}
+
+	/* TSO and throttled bulk alone are rare enough for the slab */
+	if (tx_agg)
+		smsc95xx_tx_pool_init(dev);
+
+	pdata->tx_done_pkts = 0;
+	pdata->tx_done_bytes = 0;
+	napi_enable(&pdata->napi);
+	netdev_reset_queue(net);
+
+	ret = usbnet_open(net);
+	if (ret < 0) {
+		napi_disable(&pdata->napi);
+		smsc95xx_pool_free(&pdata->tx_pool);
+		return ret;
+	}
+
+	if (adaptive_rx)
+		schedule_delayed_work(&pdata->rx_tune.work, RX_TUNE_INTERVAL);
+
 	return 0;
 }
 
+static int smsc95xx_stop(struct net_device *net)
+{
+	struct usbnet *dev = netdev_priv(net);
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+	int ret;
+
+	cancel_delayed_work_sync(&pdata->rx_tune.work);
+
+	/* Only xmit arms the aggregate flush. With the queue disabled it
+	 * can't be re-armed, and a flush already pending must not submit
+	 * after usbnet has terminated its URBs.
+	 */
+	netif_tx_disable(net);
+	hrtimer_cancel(&pdata->tx_agg_timer);
+	tasklet_kill(&pdata->tx_agg_bh);
+
+	ret = usbnet_stop(net);
+
+	/* frames still waiting for an aggregate never made it out */
+	netif_tx_lock_bh(net);
+	if (pdata->tx_agg) {
+		net->stats.tx_dropped += pdata->tx_agg_frames;
+		dev_kfree_skb_any(pdata->tx_agg);
+		pdata->tx_agg = NULL;
+		kfree_skb_list(pdata->tx_agg_held);
+		pdata->tx_agg_held = NULL;
+	}
+	netif_tx_unlock_bh(net);
+
+	/* let the Rx thread finish the URB it may be working on, nothing
+	 * may reach rx_napi_q once it is purged below */
+	skb_queue_purge(&pdata->rx_thread_q);
+	mutex_lock(&pdata->rx_thread_lock);
+	mutex_unlock(&pdata->rx_thread_lock);
+	napi_disable(&pdata->napi);
+	skb_queue_purge(&pdata->rx_napi_q);
+	skb_queue_purge(&pdata->tx_done_q);
+
+	/* aggregates still referenced hold their own page reference */
+	smsc95xx_pool_free(&pdata->tx_pool);
+
+	return ret;
+}
+
 static const struct net_device_ops smsc95xx_netdev_ops = {
-	.ndo_open		= usbnet_open,
-	.ndo_stop		= usbnet_stop,
+	.ndo_open		= smsc95xx_open,
+	.ndo_stop		= smsc95xx_stop,
 	.ndo_start_xmit		= usbnet_start_xmit,
 	.ndo_tx_timeout		= usbnet_tx_timeout,
 	.ndo_change_mtu		= usbnet_change_mtu,
@@ -1319,10 +2327,69 @@ static const struct net_device_ops smsc95xx_netdev_ops = {
 	.ndo_set_features	= smsc95xx_set_features,
 };
 
+/* the part of bind that talks to the hardware */
+static int smsc95xx_hw_init(struct usbnet *dev)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+	u32 val;
+	int ret;
+
+	/* Init all registers */
+	ret = smsc95xx_reset(dev);
+	if (ret < 0)
+		goto err;
+
+	/* detect device revision as different features may be available */
+	ret = smsc95xx_read_reg(dev, ID_REV, &val);
+	if (ret < 0)
+		goto err;
+
+	val >>= 16;
+	pdata->chip_id = val;
+	pdata->mdix_ctrl = get_mdix_status(dev->net);
+
+	if ((val == ID_REV_CHIP_ID_9500A_) || (val == ID_REV_CHIP_ID_9530_) ||
+	    (val == ID_REV_CHIP_ID_89530_) || (val == ID_REV_CHIP_ID_9730_))
+		pdata->features = (FEATURE_8_WAKEUP_FILTERS |
+			FEATURE_PHY_NLP_CROSSOVER |
+			FEATURE_REMOTE_WAKEUP);
+	else if (val == ID_REV_CHIP_ID_9512_)
+		pdata->features = FEATURE_8_WAKEUP_FILTERS;
+
+	schedule_delayed_work(&pdata->carrier_check, CARRIER_CHECK_DELAY);
+
+	return 0;
+
+err:
+	netdev_err(dev->net, "hardware init failed: %d\n", ret);
+	return ret;
+}
+
+static void smsc95xx_init_work(struct work_struct *work)
+{
+	struct smsc95xx_priv *pdata = container_of(work, struct smsc95xx_priv,
+						   init_work);
+
+	pdata->init_ret = smsc95xx_hw_init(pdata->dev);
+
+	WRITE_ONCE(pdata->init_pending, false);
+	smp_mb();
+	if (READ_ONCE(pdata->rx_mode_pending)) {
+		WRITE_ONCE(pdata->rx_mode_pending, false);
+		if (!pdata->init_ret)
+			smsc95xx_set_multicast(pdata->dev->net);
+	}
+}
+
+static int smsc95xx_napi_poll(struct napi_struct *napi, int budget);
+static void smsc95xx_tx_complete(struct smsc95xx_priv *pdata, int budget);
+static int smsc95xx_rx_thread(void *data);
+static enum hrtimer_restart smsc95xx_tx_agg_timer(struct hrtimer *timer);
+static void smsc95xx_tx_agg_flush(unsigned long data);
+
 static int smsc95xx_bind(struct usbnet *dev, struct usb_interface *intf)
 {
 	struct smsc95xx_priv *pdata = NULL;
-	u32 val;
 	int ret;
 
 	printk(KERN_INFO SMSC_CHIPNAME " v" SMSC_DRIVER_VERSION "\n");
@@ -1342,61 +2409,109 @@ static int smsc95xx_bind(struct usbnet *dev, struct usb_interface *intf)
 
 	spin_lock_init(&pdata->mac_cr_lock);
 
+	/* without it register access just goes through usbnet */
+	if (smsc95xx_ctrl_pool_init(pdata) < 0) {
+		netdev_warn(dev->net, "Unable to allocate control transfer pool\n");
+		smsc95xx_ctrl_pool_free(pdata);
+	}
+
 	/* LAN95xx devices do not alter the computed checksum of 0 to 0xffff.
 	 * RFC 2460, ipv6 UDP calculated checksum yields a result of zero must
 	 * be changed to 0xffff. RFC 768, ipv4 UDP computed checksum is zero,
 	 * it is transmitted as all ones. The zero transmitted checksum means
-	 * transmitter generated no checksum. Hence, enable csum offload only
-	 * for ipv4 packets.
+	 * transmitter generated no checksum. Hence ipv6 UDP is checksummed in
+	 * software by tx_fixup, ipv6 TCP and all of ipv4 go to the hardware.
 	 */
 	if (DEFAULT_TX_CSUM_ENABLE)
-		dev->net->features |= NETIF_F_IP_CSUM;
+		dev->net->features |= NETIF_F_IP_CSUM | NETIF_F_IPV6_CSUM;
 	if (DEFAULT_RX_CSUM_ENABLE)
 		dev->net->features |= NETIF_F_RXCSUM;
 
-	dev->net->hw_features = NETIF_F_IP_CSUM | NETIF_F_RXCSUM;
+	dev->net->hw_features = NETIF_F_IP_CSUM | NETIF_F_IPV6_CSUM |
+				NETIF_F_RXCSUM;
+
+	/* Paged skbs go out as one segment: header in the headroom, the
+	 * fragments mapped straight into the URB scatterlist where the
+	 * host controller allows it, or copied once otherwise.
+	 */
+	dev->net->features |= NETIF_F_SG;
+	dev->net->hw_features |= NETIF_F_SG;
+
+	/* TSO is done in tx_fixup, each segment gets its own checksum
+	 * preamble, so it rides on the IPv4 checksum offload setting.
+	 */
+	if (DEFAULT_TX_CSUM_ENABLE)
+		dev->net->features |= NETIF_F_TSO;
+	dev->net->hw_features |= NETIF_F_TSO;
+	netif_set_gso_max_size(dev->net, SMSC95XX_TX_GSO_MAX_SIZE);
+	dev->net->gso_max_segs = SMSC95XX_TX_GSO_MAX_SEGS;
+	dev->can_dma_sg = dev->udev->bus->no_sg_constraint;
+
+	/* software flow hash for RPS/RFS, off until enabled with ethtool */
+	dev->net->hw_features |= NETIF_F_RXHASH;
+	net_get_random_once(&smsc95xx_rx_hash_seed,
+			    sizeof(smsc95xx_rx_hash_seed));
 	set_bit(EVENT_NO_IP_ALIGN, &dev->flags);
 
 	smsc95xx_init_mac_address(dev);
 
-	/* Init all registers */
-	ret = smsc95xx_reset(dev);
-#if defined(OPENWRT_PLATFORM)
-	if (ret)
-		goto free_pdata;
-#endif
-
-	/* detect device revision as different features may be available */
-	ret = smsc95xx_read_reg(dev, ID_REV, &val);
-	if (ret < 0)
-#if defined(OPENWRT_PLATFORM)
-		goto free_pdata;
-#else
-		return ret;
-#endif
-
-	val >>= 16;
-	pdata->chip_id = val;
-	pdata->mdix_ctrl = get_mdix_status(dev->net);
-
-	if ((val == ID_REV_CHIP_ID_9500A_) || (val == ID_REV_CHIP_ID_9530_) ||
-	    (val == ID_REV_CHIP_ID_89530_) || (val == ID_REV_CHIP_ID_9730_))
-		pdata->features = (FEATURE_8_WAKEUP_FILTERS |
-			FEATURE_PHY_NLP_CROSSOVER |
-			FEATURE_REMOTE_WAKEUP);
-	else if (val == ID_REV_CHIP_ID_9512_)
-		pdata->features = FEATURE_8_WAKEUP_FILTERS;
+	/* Initialize MII structure */
+	dev->mii.dev = dev->net;
+	dev->mii.mdio_read = smsc95xx_mdio_read;
+	dev->mii.mdio_write = smsc95xx_mdio_write;
+	dev->mii.phy_id_mask = 0x1f;
+	dev->mii.reg_num_mask = 0x1f;
+	dev->mii.phy_id = SMSC95XX_INTERNAL_PHY_ID;
 
 	dev->net->netdev_ops = &smsc95xx_netdev_ops;
 	dev->net->ethtool_ops = &smsc95xx_ethtool_ops;
 	dev->net->flags |= IFF_MULTICAST;
 	dev->net->hard_header_len += SMSC95XX_TX_OVERHEAD_CSUM;
+	/* bridges and tunnels above us only look at needed_headroom */
+	dev->net->needed_headroom = SMSC95XX_TX_OVERHEAD_CSUM +
+				    SMSC95XX_TX_ZLP_FILL;
 	dev->net->min_mtu = ETH_MIN_MTU;
 	dev->net->max_mtu = ETH_DATA_LEN;
 	dev->hard_mtu = dev->net->mtu + dev->net->hard_header_len;
 
 	pdata->dev = dev;
 
+	/* The register setup, PHY reset and autoneg restart take long enough
+	 * to serialize enumeration of many adapters; the netdev is registered
+	 * right away and ndo_open waits for this to finish.
+	 */
+	INIT_WORK(&pdata->init_work, smsc95xx_init_work);
+
+	INIT_DELAYED_WORK(&pdata->rx_tune.work, smsc95xx_rx_tune);
+	skb_queue_head_init(&pdata->rx_napi_q);
+	skb_queue_head_init(&pdata->rx_thread_q);
+	mutex_init(&pdata->rx_thread_lock);
+
+	skb_queue_head_init(&pdata->tx_done_q);
+	hrtimer_init(&pdata->tx_agg_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	pdata->tx_agg_timer.function = smsc95xx_tx_agg_timer;
+	tasklet_init(&pdata->tx_agg_bh, smsc95xx_tx_agg_flush,
+		     (unsigned long)dev);
+
+	if (rx_thread_cpu >= 0 && (rx_thread_cpu >= nr_cpu_ids ||
+				   !cpu_online(rx_thread_cpu))) {
+		netdev_warn(dev->net, "Rx thread CPU %d is offline, not using it\n",
+			    rx_thread_cpu);
+	} else if (rx_thread_cpu >= 0) {
+		pdata->rx_thread = kthread_create(smsc95xx_rx_thread, pdata,
+						  "smsc95xx-rx/%d",
+						  rx_thread_cpu);
+		if (IS_ERR(pdata->rx_thread)) {
+			netdev_warn(dev->net, "Failed to create Rx thread\n");
+			pdata->rx_thread = NULL;
+		} else {
+			kthread_bind(pdata->rx_thread, rx_thread_cpu);
+			wake_up_process(pdata->rx_thread);
+		}
+	}
+	netif_napi_add(dev->net, &pdata->napi, smsc95xx_napi_poll,
+		       clamp_val(rx_napi_weight, 1, NAPI_POLL_WEIGHT));
+
 #if defined(NETRW_DRV)
 	ret = smsc_netrw_init(pdata);
 	if (ret < 0)
@@ -1404,12 +2519,24 @@ static int smsc95xx_bind(struct usbnet *dev, struct usb_interface *intf)
 #endif
 
 	INIT_DELAYED_WORK(&pdata->carrier_check, check_carrier);
-	schedule_delayed_work(&pdata->carrier_check, CARRIER_CHECK_DELAY);
+
+	if (async_init) {
+		pdata->init_pending = true;
+		schedule_work(&pdata->init_work);
+	} else {
+		pdata->init_ret = smsc95xx_hw_init(dev);
+	}
 
 	return 0;
 
-#if defined(OPENWRT_PLATFORM)
+#if defined(NETRW_DRV)
 free_pdata:
+	if (pdata->rx_thread)
+		kthread_stop(pdata->rx_thread);
+	netif_napi_del(&pdata->napi);
+	smsc95xx_pool_free(&pdata->rx_pool);
+	smsc95xx_pool_free(&pdata->tx_pool);
+	smsc95xx_ctrl_pool_free(pdata);
 	kfree(pdata);
 	return ret;
 #endif
@@ -1419,6 +2546,9 @@ static void smsc95xx_unbind(struct usbnet *dev, struct usb_interface *intf)
 {
 	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
 
+	if (pdata)
+		cancel_work_sync(&pdata->init_work);
+
 #if defined(NETRW_DRV)
 	smsc_netrw_exit(pdata);
 #endif
@@ -1429,6 +2559,14 @@ static void smsc95xx_unbind(struct usbnet *dev, struct usb_interface *intf)
 #else
 		cancel_delayed_work(&pdata->carrier_check);
 #endif
+		if (pdata->rx_thread)
+			kthread_stop(pdata->rx_thread);
+		skb_queue_purge(&pdata->rx_thread_q);
+		skb_queue_purge(&pdata->rx_napi_q);
+		netif_napi_del(&pdata->napi);
+		smsc95xx_pool_free(&pdata->rx_pool);
+		smsc95xx_pool_free(&pdata->tx_pool);
+		smsc95xx_ctrl_pool_free(pdata);
 		netif_dbg(dev, ifdown, dev->net, "free pdata\n");
 		kfree(pdata);
 		pdata = NULL;
@@ -1685,6 +2823,14 @@ static int smsc95xx_suspend(struct usb_interface *intf, pm_message_t message)
 	u32 val, link_up;
 	int ret;
 
+	/* the init work would need the device awake, don't autosuspend
+	 * under it */
+	if (work_busy(&pdata->init_work)) {
+		if (PMSG_IS_AUTO(message))
+			return -EBUSY;
+		flush_work(&pdata->init_work);
+	}
+
 	ret = usbnet_suspend(intf, message);
 	if (ret < 0) {
 		netdev_warn(dev->net, "usbnet_suspend error\n");
@@ -1692,6 +2838,7 @@ static int smsc95xx_suspend(struct usb_interface *intf, pm_message_t message)
 	}
 
 	cancel_delayed_work_sync(&pdata->carrier_check);
+	cancel_delayed_work_sync(&pdata->rx_tune.work);
 
 	if (pdata->suspend_flags) {
 		netdev_warn(dev->net, "error during last resume\n");
@@ -1936,9 +3083,13 @@ done:
 	if (ret && PMSG_IS_AUTO(message))
 		usbnet_resume(intf);
 
-	if (ret)
+	if (ret) {
 		schedule_delayed_work(&pdata->carrier_check,
 				      CARRIER_CHECK_DELAY);
+		if (adaptive_rx && netif_running(dev->net))
+			schedule_delayed_work(&pdata->rx_tune.work,
+					      RX_TUNE_INTERVAL);
+	}
 
 	return ret;
 }
@@ -1959,7 +3110,11 @@ static int smsc95xx_resume(struct usb_interface *intf)
 
 	/* do this first to ensure it's cleared even in error case */
 	pdata->suspend_flags = 0;
+	/* wakeup and suspend state changed behind our back */
+	smsc95xx_shadow_invalidate(dev);
 	schedule_delayed_work(&pdata->carrier_check, CARRIER_CHECK_DELAY);
+	if (adaptive_rx && netif_running(dev->net))
+		schedule_delayed_work(&pdata->rx_tune.work, RX_TUNE_INTERVAL);
 
 	if (suspend_flags & SUSPEND_ALLMODES) {
 		/* clear wake-up sources */
@@ -1998,6 +3153,9 @@ static int smsc95xx_reset_resume(struct usb_interface *intf)
 	struct usbnet *dev = usb_get_intfdata(intf);
 	int ret;
 
+	/* the device lost its configuration */
+	smsc95xx_shadow_invalidate(dev);
+
 	ret = smsc95xx_reset(dev);
 	if (ret < 0)
 		return ret;
@@ -2012,50 +3170,407 @@ static void smsc95xx_rx_csum_offload(struct sk_buff *skb)
 	skb_trim(skb, skb->len - 2);
 }
 
-static int smsc95xx_rx_fixup(struct usbnet *dev, struct sk_buff *skb)
+/* Clone the URB skb and point the clone at one frame inside it. Cheap to
+ * build, but every clone keeps the whole URB buffer alive until it is freed.
+ */
+static struct sk_buff *smsc95xx_rx_clone_skb(struct sk_buff *skb,
+					     unsigned char *packet, u16 size)
 {
-	/* This check is no longer done by usbnet */
-	if (skb->len < dev->net->hard_header_len)
-		return 0;
+	struct sk_buff *ax_skb;
+
+	ax_skb = skb_clone(skb, GFP_ATOMIC);
+	if (unlikely(!ax_skb))
+		return NULL;
+
+	ax_skb->len = size;
+	ax_skb->data = packet;
+	skb_set_tail_pointer(ax_skb, size);
+
+#if defined(OPENWRT_PLATFORM)
+	if (truesize_mode)
+#endif
+		ax_skb->truesize = size + sizeof(struct sk_buff);
+
+	return ax_skb;
+}
+
+/* Copy one frame into a page fragment and build the skb around it, so the
+ * URB buffer is released as soon as rx_fixup returns.
+ */
+static struct sk_buff *smsc95xx_rx_frag_skb(struct usbnet *dev,
+					    unsigned char *packet, u16 size)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+	unsigned int fragsz = SMSC95XX_RX_FRAG_SIZE(size);
+	struct sk_buff *ax_skb;
+	void *data;
+
+	data = smsc95xx_pool_alloc_frag(&pdata->rx_pool, &pdata->stats, fragsz);
+	if (likely(data)) {
+		pdata->stats.rx_pool_hits++;
+	} else {
+		pdata->stats.rx_pool_misses++;
+		data = netdev_alloc_frag(fragsz);
+		if (unlikely(!data))
+			return NULL;
+	}
+
+	ax_skb = build_skb(data, fragsz);
+	if (unlikely(!ax_skb)) {
+		skb_free_frag(data);
+		return NULL;
+	}
+
+	skb_reserve(ax_skb, SMSC95XX_RX_HEADROOM);
+	skb_put_data(ax_skb, packet, size);
+
+	return ax_skb;
+}
+
+/* Copy a short frame into a right-sized skb. Its truesize stays honest and
+ * the URB buffer is not pinned by a small packet such as a TCP ACK.
+ */
+static struct sk_buff *smsc95xx_rx_copy_skb(struct usbnet *dev,
+					    unsigned char *packet, u16 size)
+{
+	struct sk_buff *ax_skb;
+
+	ax_skb = netdev_alloc_skb_ip_align(dev->net, size);
+	if (unlikely(!ax_skb))
+		return NULL;
+
+	skb_put_data(ax_skb, packet, size);
+
+	return ax_skb;
+}
+
+static struct sk_buff *smsc95xx_rx_frame_skb(struct usbnet *dev,
+					     struct sk_buff *skb,
+					     unsigned char *packet, u16 size)
+{
+	if (size < rx_copybreak)
+		return smsc95xx_rx_copy_skb(dev, packet, size);
+
+	if (rx_frag_mode)
+		return smsc95xx_rx_frag_skb(dev, packet, size);
+
+	return smsc95xx_rx_clone_skb(skb, packet, size);
+}
+
+/* usbnet_skb_return() minus the netif_rx(), for batched delivery */
+static void smsc95xx_rx_prepare_skb(struct usbnet *dev, struct sk_buff *skb)
+{
+	struct pcpu_sw_netstats *stats64 = this_cpu_ptr(dev->stats64);
+	unsigned long flags;
+
+	skb->protocol = eth_type_trans(skb, dev->net);
+
+	flags = u64_stats_update_begin_irqsave(&stats64->syncp);
+	stats64->rx_packets++;
+	stats64->rx_bytes += skb->len;
+	u64_stats_update_end_irqrestore(&stats64->syncp, flags);
+
+	memset(skb->cb, 0, sizeof(struct skb_data));
+}
+
+static int smsc95xx_napi_poll(struct napi_struct *napi, int budget)
+{
+	struct smsc95xx_priv *pdata = container_of(napi, struct smsc95xx_priv,
+						   napi);
+	struct sk_buff *skb;
+	int work = 0;
+
+	smsc95xx_tx_complete(pdata, budget);
+
+	while (work < budget && (skb = skb_dequeue(&pdata->rx_napi_q))) {
+		smsc95xx_rx_prepare_skb(pdata->dev, skb);
+		napi_gro_receive(napi, skb);
+		work++;
+	}
+
+	/* rx_fixup may have queued more frames after the loop ran dry,
+	 * and more Tx URBs may have completed */
+	if (work < budget && napi_complete_done(napi, work) &&
+	    (!skb_queue_empty(&pdata->rx_napi_q) ||
+	     READ_ONCE(pdata->tx_done_pkts)))
+		napi_schedule(napi);
+
+	return work;
+}
+
+/* hand up all frames parsed from one URB */
+static void smsc95xx_rx_deliver(struct usbnet *dev, struct sk_buff_head *frames)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+	u32 qlen = skb_queue_len(frames);
+	struct sk_buff *skb;
+	LIST_HEAD(list);
+
+	if (!qlen)
+		return;
+
+	pdata->stats.rx_urb_frames += qlen;
+	if (qlen > pdata->stats.rx_urb_frames_max)
+		pdata->stats.rx_urb_frames_max = qlen;
+
+	if (test_bit(EVENT_RX_PAUSED, &dev->flags))
+		goto single;
+
+	if (rx_napi) {
+		spin_lock(&pdata->rx_napi_q.lock);
+		skb_queue_splice_tail_init(frames, &pdata->rx_napi_q);
+		spin_unlock(&pdata->rx_napi_q.lock);
+
+		napi_schedule(&pdata->napi);
+		return;
+	}
+
+	if (rx_list) {
+		while ((skb = __skb_dequeue(frames))) {
+			smsc95xx_rx_prepare_skb(dev, skb);
+			list_add_tail(&skb->list, &list);
+		}
+
+		netif_receive_skb_list(&list);
+		return;
+	}
 
-	while (skb->len > 0) {
-		u32 header, align_count;
-		struct sk_buff *ax_skb;
-		unsigned char *packet;
+single:
+	while ((skb = __skb_dequeue(frames)))
+		usbnet_skb_return(dev, skb);
+}
+
+/* Cheap L3/L4 flow hash over headers rx_fixup has just brought into the
+ * cache, so RPS/RFS can spread flows without running the flow dissector.
+ * skb->data still points at the Ethernet header.
+ */
+static void smsc95xx_rx_hash(struct sk_buff *skb)
+{
+	enum pkt_hash_types type = PKT_HASH_TYPE_L3;
+	unsigned int nhoff = ETH_HLEN;
+	u32 saddr, daddr, ports = 0;
+	u8 proto;
+
+	if (skb->len < ETH_HLEN)
+		return;
+
+	/* the mac header offset is only set by eth_type_trans() later */
+	switch (((struct ethhdr *)skb->data)->h_proto) {
+	case htons(ETH_P_IP): {
+		const struct iphdr *iph;
+
+		if (skb->len < nhoff + sizeof(*iph))
+			return;
+
+		iph = (const struct iphdr *)(skb->data + nhoff);
+		saddr = (__force u32)iph->saddr;
+		daddr = (__force u32)iph->daddr;
+		proto = iph->protocol;
+		nhoff += iph->ihl * 4;
+
+		/* only the first fragment carries the ports */
+		if (ip_is_fragment(iph))
+			proto = 0;
+		break;
+	}
+	case htons(ETH_P_IPV6): {
+		const struct ipv6hdr *ip6h;
+
+		if (skb->len < nhoff + sizeof(*ip6h))
+			return;
+
+		ip6h = (const struct ipv6hdr *)(skb->data + nhoff);
+		saddr = ipv6_addr_hash(&ip6h->saddr);
+		daddr = ipv6_addr_hash(&ip6h->daddr);
+		proto = ip6h->nexthdr;
+		nhoff += sizeof(*ip6h);
+		break;
+	}
+	default:
+		return;
+	}
+
+	if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP) &&
+	    skb->len >= nhoff + 4) {
+		ports = get_unaligned((u32 *)(skb->data + nhoff));
+		type = PKT_HASH_TYPE_L4;
+	}
+
+	skb_set_hash(skb, jhash_3words(saddr, daddr, ports ^ proto,
+				       smsc95xx_rx_hash_seed), type);
+}
+
+static void smsc95xx_rx_error(struct usbnet *dev, u32 header)
+{
+	netif_dbg(dev, rx_err, dev->net, "Error header=0x%08x\n", header);
+	dev->net->stats.rx_errors++;
+	dev->net->stats.rx_dropped++;
+
+	if (header & RX_STS_CRC_) {
+		dev->net->stats.rx_crc_errors++;
+	} else {
+		if (header & (RX_STS_TL_ | RX_STS_RF_))
+			dev->net->stats.rx_frame_errors++;
+
+		if ((header & RX_STS_LE_) && (!(header & RX_STS_FT_)))
+			dev->net->stats.rx_length_errors++;
+	}
+}
+
+/* Does pos look like the status word of a good frame that fits in the URB?
+ * On success *next is where the following status word would be.
+ */
+static bool smsc95xx_rx_header_ok(struct sk_buff *skb, u32 pos, u32 *next)
+{
+	u32 header, size;
+
+	if (pos + 4 + NET_IP_ALIGN > skb->len)
+		return false;
+
+	header = get_unaligned_le32(skb->data + pos);
+	if (header & (BIT(31) | RX_STS_ES_))
+		return false;
+
+	size = (header & RX_STS_FL_) >> 16;
+	if (size < ETH_ZLEN + 4 || size > ETH_FRAME_LEN + 12)
+		return false;
+
+	pos += 4 + NET_IP_ALIGN;
+	if (pos + size > skb->len)
+		return false;
+
+	*next = pos + size + (4 - ((size + NET_IP_ALIGN) % 4)) % 4;
+	return true;
+}
+
+/* Frames always start on a 4-byte boundary, so look at each of them past
+ * the broken status word for one that is followed either by the end of
+ * the URB or by another plausible status word.
+ */
+static bool smsc95xx_rx_resync(struct sk_buff *skb, u32 *pos)
+{
+	u32 p, next, dummy;
+
+	for (p = *pos + 4; p + 4 + NET_IP_ALIGN <= skb->len; p += 4) {
+		if (!smsc95xx_rx_header_ok(skb, p, &next))
+			continue;
+
+		if (next >= skb->len || smsc95xx_rx_header_ok(skb, next, &dummy)) {
+			*pos = p;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* First pass: walk the RX status words from *pos and describe up to max
+ * good frames, without touching any frame data. Errored frames are
+ * accounted and skipped here. Sets *bad when the rest of the URB cannot
+ * be parsed anymore.
+ */
+static int smsc95xx_rx_scan(struct usbnet *dev, struct sk_buff *skb, u32 *pos,
+			    struct smsc95xx_rx_desc *desc, int max, bool *bad,
+			    bool *resynced)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+	u32 min_size = ETH_HLEN + 4;	/* header + FCS */
+	int n = 0;
+
+	*bad = false;
+
+	/* the COE status word follows the frame */
+	if (dev->net->features & NETIF_F_RXCSUM)
+		min_size += 2;
+
+	while (*pos < skb->len && n < max) {
+		u32 header, align_count, offset;
 		u16 size;
 
-		header = get_unaligned_le32(skb->data);
-		skb_pull(skb, 4 + NET_IP_ALIGN);
-		packet = skb->data;
+		if (unlikely(*pos + 4 + NET_IP_ALIGN > skb->len)) {
+			netif_dbg(dev, rx_err, dev->net,
+				  "truncated header at %u\n", *pos);
+			*bad = true;
+			break;
+		}
+
+		header = get_unaligned_le32(skb->data + *pos);
+		offset = *pos + 4 + NET_IP_ALIGN;
 
 		/* get the packet length */
 		size = (u16)((header & RX_STS_FL_) >> 16);
 		align_count = (4 - ((size + NET_IP_ALIGN) % 4)) % 4;
 
 		if (unlikely(header & RX_STS_ES_)) {
-			netif_dbg(dev, rx_err, dev->net,
-				  "Error header=0x%08x\n", header);
-			dev->net->stats.rx_errors++;
-			dev->net->stats.rx_dropped++;
-
-			if (header & RX_STS_CRC_) {
-				dev->net->stats.rx_crc_errors++;
-			} else {
-				if (header & (RX_STS_TL_ | RX_STS_RF_))
-					dev->net->stats.rx_frame_errors++;
-
-				if ((header & RX_STS_LE_) &&
-					(!(header & RX_STS_FT_)))
-					dev->net->stats.rx_length_errors++;
-			}
-		} else {
+			smsc95xx_rx_error(dev, header);
+		} else if (unlikely(size > (ETH_FRAME_LEN + 12) ||
+				    size < min_size ||
+				    offset + size > skb->len)) {
 			/* ETH_FRAME_LEN + 4(CRC) + 2(COE) + 4(Vlan) */
-			if (unlikely(size > (ETH_FRAME_LEN + 12))) {
+			netif_dbg(dev, rx_err, dev->net,
+				  "size err header=0x%08x\n", header);
+			pdata->stats.rx_bad_headers++;
+
+			if (rx_resync && smsc95xx_rx_resync(skb, pos)) {
 				netif_dbg(dev, rx_err, dev->net,
-					  "size err header=0x%08x\n", header);
-				return 0;
+					  "resynced at %u\n", *pos);
+				pdata->stats.rx_resyncs++;
+				/* the URB still counts as good to usbnet,
+				 * the frame lost at the bad header doesn't */
+				dev->net->stats.rx_errors++;
+				dev->net->stats.rx_length_errors++;
+				*resynced = true;
+				continue;
 			}
 
+			*bad = true;
+			break;
+		} else {
+			desc[n].header = header;
+			desc[n].offset = offset;
+			desc[n].size = size;
+			n++;
+
+			if (*resynced)
+				pdata->stats.rx_resync_salvaged++;
+		}
+
+		/* padding bytes before the next frame starts */
+		*pos = offset + size + align_count;
+	}
+
+	return n;
+}
+
+static int __smsc95xx_rx_fixup(struct usbnet *dev, struct sk_buff *skb)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+	struct smsc95xx_rx_desc *desc = pdata->rx_desc;
+	struct sk_buff_head frames;
+	bool bad = false, resynced = false;
+	u32 pos = 0;
+	int i, n;
+
+	/* This check is no longer done by usbnet */
+	if (skb->len < dev->net->hard_header_len)
+		return 0;
+
+	pdata->stats.rx_urbs++;
+	pdata->stats.rx_urb_bytes += skb->len;
+
+	__skb_queue_head_init(&frames);
+
+	while (pos < skb->len && !bad) {
+		n = smsc95xx_rx_scan(dev, skb, &pos, desc,
+				     SMSC95XX_RX_DESC_MAX, &bad, &resynced);
+
+		/* Second pass: build the skbs for the described frames */
+		for (i = 0; i < n; i++) {
+			struct sk_buff *ax_skb;
+
+			if (i + 1 < n)
+				prefetch(skb->data + desc[i + 1].offset);
+
 #if defined(NETRW_DRV)
 			/* we only care the skb in driver level,
 			 * which means none of our business whether
@@ -2063,47 +3578,94 @@ static int smsc95xx_rx_fixup(struct usbnet *dev, struct sk_buff *skb)
 			netrw_skb_rx_hook(dev, skb);
 #endif
 
-			/* last frame in this batch */
-			if (skb->len == size) {
-				if (dev->net->features & NETIF_F_RXCSUM)
-					smsc95xx_rx_csum_offload(skb);
-				skb_trim(skb, skb->len - 4); /* remove fcs */
-#if defined(OPENWRT_PLATFORM)
-				if (truesize_mode)
-#endif
-					skb->truesize = size + sizeof(struct sk_buff);
-
-				return 1;
-			}
-
-			ax_skb = skb_clone(skb, GFP_ATOMIC);
+			/* every frame, including the last one in this batch,
+			 * is handed up by the driver; usbnet frees the URB skb
+			 * itself (FLAG_MULTI_PACKET) */
+			ax_skb = smsc95xx_rx_frame_skb(dev, skb,
+						       skb->data + desc[i].offset,
+						       desc[i].size);
 			if (unlikely(!ax_skb)) {
 				netdev_warn(dev->net, "Error allocating skb\n");
-				return 0;
+				bad = true;
+				break;
 			}
 
-			ax_skb->len = size;
-			ax_skb->data = packet;
-			skb_set_tail_pointer(ax_skb, size);
-
 			if (dev->net->features & NETIF_F_RXCSUM)
 				smsc95xx_rx_csum_offload(ax_skb);
 			skb_trim(ax_skb, ax_skb->len - 4); /* remove fcs */
-#if defined(OPENWRT_PLATFORM)
-			if (truesize_mode)
-#endif
-				ax_skb->truesize = size + sizeof(struct sk_buff);
 
-			usbnet_skb_return(dev, ax_skb);
+			if (dev->net->features & NETIF_F_RXHASH)
+				smsc95xx_rx_hash(ax_skb);
+
+			__skb_queue_tail(&frames, ax_skb);
 		}
+	}
 
-		skb_pull(skb, size);
+	/* frames parsed before an error are still good */
+	smsc95xx_rx_deliver(dev, &frames);
 
-		/* padding bytes before the next frame starts */
-		if (skb->len)
-			skb_pull(skb, align_count);
+	return !bad;
+}
+
+static int smsc95xx_rx_thread(void *data)
+{
+	struct smsc95xx_priv *pdata = data;
+	struct usbnet *dev = pdata->dev;
+	struct sk_buff *skb;
+
+	for (;;) {
+		/* state first, so a wakeup from kthread_stop isn't lost */
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop())
+			break;
+		if (skb_queue_empty(&pdata->rx_thread_q)) {
+			schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+
+		mutex_lock(&pdata->rx_thread_lock);
+		while ((skb = skb_dequeue(&pdata->rx_thread_q))) {
+			/* delivery paths expect softirq-like context */
+			local_bh_disable();
+			if (!__smsc95xx_rx_fixup(dev, skb))
+				dev->net->stats.rx_errors++;
+			local_bh_enable();
+
+			dev_consume_skb_any(skb);
+		}
+		mutex_unlock(&pdata->rx_thread_lock);
+
+		cond_resched();
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+static int smsc95xx_rx_fixup(struct usbnet *dev, struct sk_buff *skb)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+	struct sk_buff *rx_skb;
+
+	if (!pdata->rx_thread)
+		return __smsc95xx_rx_fixup(dev, skb);
+
+	/* leave the heavy lifting to the pinned thread; the clone shares
+	 * the URB data while usbnet drops its own reference */
+	if (skb_queue_len(&pdata->rx_thread_q) >= SMSC95XX_RX_THREAD_BACKLOG) {
+		pdata->stats.rx_thread_drops++;
+		dev->net->stats.rx_dropped++;
+		return 1;
 	}
 
+	rx_skb = skb_clone(skb, GFP_ATOMIC);
+	if (unlikely(!rx_skb))
+		return 0;
+
+	skb_queue_tail(&pdata->rx_thread_q, rx_skb);
+	wake_up_process(pdata->rx_thread);
+
 	return 1;
 }
 
@@ -2128,61 +3690,542 @@ static bool smsc95xx_can_tx_checksum(struct sk_buff *skb)
 
        if (skb->len <= 45)
 	       return false;
+       /* the hardware would send a computed 0 as is, illegal for ipv6 UDP */
+       if (skb->protocol == htons(ETH_P_IPV6) &&
+	   skb->csum_offset == offsetof(struct udphdr, check))
+	       return false;
        return skb->csum_offset < (len - (4 + 1));
 }
 
-static struct sk_buff *smsc95xx_tx_fixup(struct usbnet *dev,
-					 struct sk_buff *skb, gfp_t flags)
+/* Work out the TX command words for one frame. Returns how many bytes they
+ * take in front of the frame; *sw_csum is set when the hardware can't
+ * checksum this frame and the caller has to do it in software.
+ */
+static int smsc95xx_tx_cmd(struct sk_buff *skb, u32 *cmd, bool *sw_csum)
 {
+	u32 len = skb->len;
+
+	*sw_csum = false;
+
+	if (skb->ip_summed == CHECKSUM_PARTIAL) {
+		if (smsc95xx_can_tx_checksum(skb)) {
+			cmd[0] = (len + 4) | TX_CMD_A_FIRST_SEG_ |
+				 TX_CMD_A_LAST_SEG_;
+			cmd[1] = (len + 4) | TX_CMD_B_CSUM_ENABLE;
+			cmd[2] = smsc95xx_calc_csum_preamble(skb);
+			return SMSC95XX_TX_OVERHEAD_CSUM;
+		}
+
+		/* workaround - hardware tx checksum does not work
+		 * properly with extremely small packets, nor with
+		 * ipv6 UDP (see smsc95xx_can_tx_checksum) */
+		*sw_csum = true;
+	}
+
+	cmd[0] = len | TX_CMD_A_FIRST_SEG_ | TX_CMD_A_LAST_SEG_;
+	cmd[1] = len;
+	return SMSC95XX_TX_OVERHEAD;
+}
+
+/* checksum the frame of skb whose bytes are at data */
+static void smsc95xx_tx_sw_csum(struct sk_buff *skb, u8 *data)
+{
+	long csstart = skb_checksum_start_offset(skb);
+	__wsum calc = csum_partial(data + csstart, skb->len - csstart, 0);
+
+	/* same zero fixup skb_checksum_help does, a UDP 0 means no checksum */
+	*((__sum16 *)(data + csstart + skb->csum_offset)) =
+		csum_fold(calc) ?: CSUM_MANGLED_0;
+}
+
+/* Write the command words; fill bytes between TX_CMD_B and the buffer
+ * are skipped by the device through the data start offset.
+ */
+static void smsc95xx_tx_put_cmd(u8 *ptr, const u32 *cmd, int hlen, int fill)
+{
+	put_unaligned_le32(cmd[0] | (fill << 16), ptr);
+	put_unaligned_le32(cmd[1], ptr + 4);
+	if (fill)
+		memset(ptr + 8, 0, fill);
+	if (hlen == SMSC95XX_TX_OVERHEAD_CSUM)
+		put_unaligned_le32(cmd[2], ptr + 8 + fill);
+}
+
+/* With FLAG_SEND_ZLP a transfer of exactly n * wMaxPacketSize costs an
+ * extra zero length packet. Returns the fill bytes that avoid it.
+ */
+static int smsc95xx_tx_zlp_fill(struct usbnet *dev, unsigned int len)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+
+	if (len % dev->maxpacket)
+		return 0;
+
+	pdata->stats.tx_zlp_avoided++;
+	return SMSC95XX_TX_ZLP_FILL;
+}
+
+/* append one framed skb to the aggregate, next frame starts DWORD aligned */
+static void smsc95xx_tx_agg_add(struct sk_buff *agg, struct sk_buff *skb)
+{
+	u32 cmd[3];
+	bool sw_csum;
+	u8 *hdr, *data;
+	int hlen;
+
+	hlen = smsc95xx_tx_cmd(skb, cmd, &sw_csum);
+
+	hdr = skb_put(agg, hlen);
+	data = skb_put(agg, skb->len);
+	skb_copy_bits(skb, 0, data, skb->len);
+	if (sw_csum)
+		smsc95xx_tx_sw_csum(skb, data);
+	smsc95xx_tx_put_cmd(hdr, cmd, hlen, 0);
+
+	skb_put_zero(agg, ALIGN(skb->len, 4) - skb->len);
+}
+
+/* Queue a finished URB for the completion batch reaped in NAPI poll.
+ * usbnet frees URB skbs from its bh and from xmit error paths alike.
+ */
+static void smsc95xx_tx_done(struct sk_buff *skb, struct sk_buff *held)
+{
+	struct usbnet *dev = netdev_priv(skb->dev);
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+	struct sk_buff *next;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pdata->tx_done_q.lock, flags);
+	pdata->tx_done_pkts++;
+	pdata->tx_done_bytes += skb->len;
+	for (; held; held = next) {
+		next = held->next;
+		__skb_queue_tail(&pdata->tx_done_q, held);
+	}
+	spin_unlock_irqrestore(&pdata->tx_done_q.lock, flags);
+
+	napi_schedule(&pdata->napi);
+
+	/* a URB slot is free again, a throttled aggregate may go out now */
+	if (READ_ONCE(pdata->tx_agg) && netif_running(dev->net))
+		tasklet_schedule(&pdata->tx_agg_bh);
+}
+
+/* URB skb that is the stack's own skb: chain to its original destructor */
+static void smsc95xx_tx_destructor(struct sk_buff *skb)
+{
+	void (*destructor)(struct sk_buff *skb) = SMSC95XX_TX_CB(skb)->destructor;
+
+	smsc95xx_tx_done(skb, NULL);
+
+	skb->destructor = destructor;
+	if (destructor)
+		destructor(skb);
+}
+
+/* aggregate: the frames packed into it are released with the batch */
+static void smsc95xx_tx_agg_destructor(struct sk_buff *skb)
+{
+	smsc95xx_tx_done(skb, SMSC95XX_TX_CB(skb)->held);
+}
+
+/* report a completion batch to BQL and free the skbs it held in bulk */
+static void smsc95xx_tx_complete(struct smsc95xx_priv *pdata, int budget)
+{
+	struct sk_buff_head done;
+	unsigned int pkts, bytes;
+	struct sk_buff *skb;
+
+	__skb_queue_head_init(&done);
+
+	spin_lock_irq(&pdata->tx_done_q.lock);
+	skb_queue_splice_init(&pdata->tx_done_q, &done);
+	pkts = pdata->tx_done_pkts;
+	bytes = pdata->tx_done_bytes;
+	pdata->tx_done_pkts = 0;
+	pdata->tx_done_bytes = 0;
+	spin_unlock_irq(&pdata->tx_done_q.lock);
+
+	if (!pkts)
+		return;
+
+	netdev_completed_queue(pdata->dev->net, pkts, bytes);
+	pdata->stats.tx_done_batches++;
+	pdata->stats.tx_done_urbs += pkts;
+
+	while ((skb = __skb_dequeue(&done)))
+		napi_consume_skb(skb, budget);
+}
+
+/* Keep the aggregate off wMaxPacketSize multiples: drop the padding
+ * after the last frame, or when it has none, move that frame behind
+ * fill bytes skipped through its data start offset.
+ */
+static void smsc95xx_tx_agg_zlp(struct usbnet *dev, struct sk_buff *agg,
+				u32 last)
+{
+	u8 *hdr = agg->data + last;
+	u32 cmd_a = get_unaligned_le32(hdr);
+	u32 size = cmd_a & TX_CMD_A_BUF_SIZE_;
+	u32 tail = agg->len - last - SMSC95XX_TX_OVERHEAD;
+	int fill;
+
+	fill = smsc95xx_tx_zlp_fill(dev, agg->len);
+	if (!fill)
+		return;
+
+	if (tail > size) {
+		skb_trim(agg, agg->len - (tail - size));
+		return;
+	}
+
+	/* tx_agg reserved the tailroom for this */
+	skb_put(agg, fill);
+	memmove(hdr + SMSC95XX_TX_OVERHEAD + fill, hdr + SMSC95XX_TX_OVERHEAD,
+		tail);
+	memset(hdr + SMSC95XX_TX_OVERHEAD, 0, fill);
+	put_unaligned_le32(cmd_a | (fill << 16), hdr);
+}
+
+/* detach the pending aggregate so it can be handed to usbnet */
+static struct sk_buff *smsc95xx_tx_agg_close(struct usbnet *dev)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+	struct sk_buff *agg = pdata->tx_agg;
+
+	if (!agg)
+		return NULL;
+
+	pdata->tx_agg = NULL;
+	hrtimer_try_to_cancel(&pdata->tx_agg_timer);
+
+	smsc95xx_tx_agg_zlp(dev, agg, pdata->tx_agg_last);
+
+	pdata->stats.tx_agg_urbs++;
+	pdata->stats.tx_agg_frames += pdata->tx_agg_frames;
+	if (pdata->tx_agg_frames > pdata->stats.tx_agg_frames_max)
+		pdata->stats.tx_agg_frames_max = pdata->tx_agg_frames;
+
+	/* tx_bytes count the frames, not the command words around them */
+	usbnet_set_skb_tx_stats(agg, pdata->tx_agg_frames,
+				(long)pdata->tx_agg_payload - agg->len);
+
+	SMSC95XX_TX_CB(agg)->held = pdata->tx_agg_held;
+	agg->destructor = smsc95xx_tx_agg_destructor;
+	pdata->tx_agg_held = NULL;
+
+	return agg;
+}
+
+/* usbnet has a single queue of tx_qlen URBs; keep the last
+ * tx_prio_reserve of them free of bulk data so priority frames find a
+ * slot without waiting for a bulk transfer to complete.
+ */
+static bool smsc95xx_tx_bulk_throttled(struct usbnet *dev)
+{
+	if (tx_prio_reserve <= 0)
+		return false;
+
+	return dev->txq.qlen >= max_t(int, dev->tx_qlen - tx_prio_reserve, 1);
+}
+
+static void smsc95xx_tx_agg_hold(struct smsc95xx_priv *pdata, u64 ns)
+{
+	if (!hrtimer_active(&pdata->tx_agg_timer))
+		hrtimer_start(&pdata->tx_agg_timer, ns_to_ktime(ns),
+			      HRTIMER_MODE_REL);
+}
+
+/* send one frame in its own URB, command words pushed into its headroom */
+static struct sk_buff *smsc95xx_tx_single(struct usbnet *dev,
+					  struct sk_buff *skb)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
 	bool csum = skb->ip_summed == CHECKSUM_PARTIAL;
 	int overhead = csum ? SMSC95XX_TX_OVERHEAD_CSUM : SMSC95XX_TX_OVERHEAD;
-	u32 tx_cmd_a, tx_cmd_b;
-	void *ptr;
+	bool sw_csum;
+	u32 cmd[3];
+	int hlen, fill;
 
-	/* We do not advertise SG, so skbs should be already linearized */
-	BUG_ON(skb_shinfo(skb)->nr_frags);
+	/* Without SG DMA the fragments have to be gathered into the linear
+	 * area. The aggregation path copies them in directly.
+	 */
+	if (skb_is_nonlinear(skb) && !dev->can_dma_sg) {
+		pdata->stats.tx_linearized++;
+		if (skb_linearize(skb))
+			goto drop;
+	}
 
 	/* Make writable and expand header space by overhead if required */
-	if (skb_cow_head(skb, overhead)) {
-		/* Must deallocate here as returning NULL to indicate error
-		 * means the skb won't be deallocated in the caller.
-		 */
-		dev_kfree_skb_any(skb);
-		return NULL;
-	}
+	if (skb_headroom(skb) < overhead || skb_header_cloned(skb))
+		pdata->stats.tx_realloc++;
+	if (skb_cow_head(skb, overhead))
+		goto drop;
 
 #if defined(NETRW_DRV)
 	netrw_skb_tx_hook(dev, skb);
 #endif
 
-	tx_cmd_b = (u32)skb->len;
-	tx_cmd_a = tx_cmd_b | TX_CMD_A_FIRST_SEG_ | TX_CMD_A_LAST_SEG_;
+	hlen = smsc95xx_tx_cmd(skb, cmd, &sw_csum);
+	fill = smsc95xx_tx_zlp_fill(dev, hlen + skb->len);
+	if (fill && skb_cow_head(skb, hlen + fill))
+		goto drop;
 
-	if (csum) {
-		if (!smsc95xx_can_tx_checksum(skb)) {
-			/* workaround - hardware tx checksum does not work
-			 * properly with extremely small packets */
-			long csstart = skb_checksum_start_offset(skb);
-			__wsum calc = csum_partial(skb->data + csstart,
-				skb->len - csstart, 0);
-			*((__sum16 *)(skb->data + csstart
-				+ skb->csum_offset)) = csum_fold(calc);
-
-			csum = false;
+	if (sw_csum) {
+		if (skb_is_nonlinear(skb)) {
+			if (skb_checksum_help(skb))
+				goto drop;
 		} else {
-			u32 csum_preamble = smsc95xx_calc_csum_preamble(skb);
-			ptr = skb_push(skb, 4);
-			put_unaligned_le32(csum_preamble, ptr);
+			smsc95xx_tx_sw_csum(skb, skb->data);
+		}
+	}
+
+	smsc95xx_tx_put_cmd(skb_push(skb, hlen + fill), cmd, hlen, fill);
+
+	/* FLAG_MULTI_PACKET leaves tx accounting to the minidriver */
+	usbnet_set_skb_tx_stats(skb, 1, 0);
+
+	return skb;
+
+drop:
+	/* Must deallocate here as returning NULL to indicate error
+	 * means the skb won't be deallocated in the caller. With
+	 * FLAG_MULTI_PACKET usbnet doesn't count it as dropped either.
+	 */
+	dev->net->stats.tx_dropped++;
+	dev_kfree_skb_any(skb);
+	return NULL;
+}
+
+/* Aggregate buffers come from the Tx pool when it has a free one that
+ * is large enough, from the slab otherwise.
+ */
+static struct sk_buff *smsc95xx_tx_alloc_agg(struct usbnet *dev,
+					     unsigned int size)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+	unsigned int truesize = PAGE_SIZE << SMSC95XX_TX_POOL_ORDER;
+	struct sk_buff *skb;
+	struct page *page;
+
+	if (size <= SKB_WITH_OVERHEAD(truesize)) {
+		page = smsc95xx_pool_get_page(&pdata->tx_pool,
+					      &pdata->stats.tx_pool_high_water);
+		if (page) {
+			/* the skb head owns a reference until it is freed */
+			page_ref_inc(page);
+			skb = build_skb(page_address(page), truesize);
+			if (skb) {
+				pdata->stats.tx_pool_hits++;
+				return skb;
+			}
+			put_page(page);
+		}
+	}
+
+	pdata->stats.tx_pool_misses++;
+	return alloc_skb(max_t(unsigned int, size, SMSC95XX_TX_AGG_SIZE),
+			 GFP_ATOMIC);
+}
+
+/* Pack frames back to back into one bulk-out transfer. Returns the
+ * aggregate when it has to go out now, or NULL while it is still being
+ * filled. A NULL skb is a flush request from the hold timer. GSO skbs
+ * are segmented here and all of their segments share one aggregate.
+ * With now set the aggregate is sent right after skb is added to it.
+ */
+static struct sk_buff *smsc95xx_tx_agg(struct usbnet *dev, struct sk_buff *skb,
+				       bool now)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+	struct sk_buff *out = NULL;
+	struct sk_buff *segs, *next;
+	unsigned int need = SMSC95XX_TX_ZLP_FILL;
+
+	if (!skb) {
+		/* still throttled: wait for the next completion or timeout */
+		if (pdata->tx_agg && smsc95xx_tx_bulk_throttled(dev)) {
+			smsc95xx_tx_agg_hold(pdata, SMSC95XX_TX_AGG_FLUSH_NS);
+			return NULL;
+		}
+		return smsc95xx_tx_agg_close(dev);
+	}
+
+	if (skb_is_gso(skb)) {
+		segs = skb_gso_segment(skb, dev->net->features &
+					    ~NETIF_F_GSO_MASK);
+		if (IS_ERR_OR_NULL(segs)) {
+			dev->net->stats.tx_dropped++;
+			dev_kfree_skb_any(skb);
+			return NULL;
+		}
+		pdata->stats.tx_gso_skbs++;
+		dev_consume_skb_any(skb);
+	} else {
+		segs = skb;
+		skb->next = NULL;
+	}
+
+	for (skb = segs; skb; skb = skb->next)
+		need += SMSC95XX_TX_OVERHEAD_CSUM + ALIGN(skb->len, 4);
+
+	if (pdata->tx_agg && skb_tailroom(pdata->tx_agg) < need)
+		out = smsc95xx_tx_agg_close(dev);
+
+	if (!pdata->tx_agg) {
+		pdata->tx_agg = smsc95xx_tx_alloc_agg(dev, need);
+		if (unlikely(!pdata->tx_agg)) {
+			pdata->stats.tx_alloc_fail++;
+
+			/* a plain frame can still go out on its own */
+			if (!out && !segs->next)
+				return smsc95xx_tx_single(dev, segs);
+
+			for (skb = segs; skb; skb = next) {
+				next = skb->next;
+				dev->net->stats.tx_dropped++;
+				dev_kfree_skb_any(skb);
+			}
+			return out;
+		}
+
+		pdata->tx_agg->dev = dev->net;
+		pdata->tx_agg_frames = 0;
+		pdata->tx_agg_payload = 0;
+	}
 
-			tx_cmd_a += 4;
-			tx_cmd_b += 4;
-			tx_cmd_b |= TX_CMD_B_CSUM_ENABLE;
+	for (skb = segs; skb; skb = next) {
+		next = skb->next;
+		skb_mark_not_on_list(skb);
+
+#if defined(NETRW_DRV)
+		netrw_skb_tx_hook(dev, skb);
+#endif
+
+		pdata->tx_agg_last = pdata->tx_agg->len;
+		smsc95xx_tx_agg_add(pdata->tx_agg, skb);
+		pdata->tx_agg_frames++;
+		pdata->tx_agg_payload += skb->len;
+
+		/* keep the frame until the URB is done, then free in bulk */
+		skb->next = pdata->tx_agg_held;
+		pdata->tx_agg_held = skb;
+	}
+
+	if (now)
+		goto send;
+
+	/* bulk waits for the in-flight URBs to drain below the priority
+	 * reserve, only a full aggregate or the timer sends it anyway */
+	if (smsc95xx_tx_bulk_throttled(dev)) {
+		pdata->stats.tx_bulk_throttled++;
+		smsc95xx_tx_agg_hold(pdata, SMSC95XX_TX_AGG_FLUSH_NS);
+		return out;
+	}
+
+	if (tx_agg && pdata->tx_agg_frames < tx_agg_max_frames) {
+		/* the stack promised another frame; the timer only guards
+		 * against that promise being broken by a stopped queue */
+		if (netdev_xmit_more()) {
+			smsc95xx_tx_agg_hold(pdata, SMSC95XX_TX_AGG_FLUSH_NS);
+			return out;
+		}
+
+		if (tx_agg_hold > 0) {
+			smsc95xx_tx_agg_hold(pdata, tx_agg_hold * NSEC_PER_USEC);
+			return out;
 		}
 	}
 
-	ptr = skb_push(skb, 8);
-	put_unaligned_le32(tx_cmd_a, ptr);
-	put_unaligned_le32(tx_cmd_b, ptr+4);
+send:
+	if (!out)
+		return smsc95xx_tx_agg_close(dev);
+
+	/* a full aggregate goes out with this call, send the rest after it */
+	tasklet_schedule(&pdata->tx_agg_bh);
+	return out;
+}
+
+static enum hrtimer_restart smsc95xx_tx_agg_timer(struct hrtimer *timer)
+{
+	struct smsc95xx_priv *pdata = container_of(timer, struct smsc95xx_priv,
+						   tx_agg_timer);
+
+	tasklet_schedule(&pdata->tx_agg_bh);
+	return HRTIMER_NORESTART;
+}
+
+static void smsc95xx_tx_agg_flush(unsigned long data)
+{
+	struct usbnet *dev = (struct usbnet *)data;
+
+	/* scheduled by a completion while the interface is going down */
+	if (!netif_running(dev->net))
+		return;
+
+	/* tx_fixup sees a NULL skb and releases the pending aggregate */
+	netif_tx_lock_bh(dev->net);
+	usbnet_start_xmit(NULL, dev->net);
+	netif_tx_unlock_bh(dev->net);
+}
+
+/* Small frames (TCP ACKs, DNS, ARP) and interactive traffic form the
+ * priority lane; everything else is bulk.
+ */
+static bool smsc95xx_tx_is_prio(struct sk_buff *skb)
+{
+	if (skb_is_gso(skb))
+		return false;
+
+	return skb->priority >= TC_PRIO_INTERACTIVE ||
+	       skb->len <= SMSC95XX_TX_PRIO_LEN;
+}
+
+static struct sk_buff *__smsc95xx_tx_fixup(struct usbnet *dev,
+					   struct sk_buff *skb)
+{
+	struct smsc95xx_priv *pdata = (struct smsc95xx_priv *)(dev->data[0]);
+
+	/* While bulk is throttled, priority frames don't wait for a slot
+	 * to free up. They can't overtake a held aggregate either, that
+	 * would reorder their flow: one that finds an aggregate pending
+	 * joins it and sends it out now. Unthrottled, they go the same
+	 * way as everything else and are aggregated with it.
+	 */
+	if (tx_prio_reserve > 0 && skb && smsc95xx_tx_is_prio(skb) &&
+	    smsc95xx_tx_bulk_throttled(dev)) {
+		pdata->stats.tx_prio_frames++;
+		if (pdata->tx_agg)
+			return smsc95xx_tx_agg(dev, skb, true);
+		return smsc95xx_tx_single(dev, skb);
+	}
+
+	/* keep going through the aggregation path until nothing is pending,
+	 * TSO super-packets are always split and packed there, and so is
+	 * bulk traffic that has to be held back for the priority lane */
+	if (tx_agg || pdata->tx_agg || !skb || skb_is_gso(skb) ||
+	    smsc95xx_tx_bulk_throttled(dev))
+		return smsc95xx_tx_agg(dev, skb, false);
+
+	return smsc95xx_tx_single(dev, skb);
+}
+
+static struct sk_buff *smsc95xx_tx_fixup(struct usbnet *dev,
+					 struct sk_buff *skb, gfp_t flags)
+{
+	skb = __smsc95xx_tx_fixup(dev, skb);
+	if (!skb)
+		return NULL;
+
+	/* the skb_data usbnet keeps in skb->cb leaves room for one pointer */
+	BUILD_BUG_ON(sizeof(struct skb_data) + sizeof(struct smsc95xx_tx_cb) >
+		     sizeof(skb->cb));
+
+	if (skb->destructor != smsc95xx_tx_agg_destructor) {
+		SMSC95XX_TX_CB(skb)->destructor = skb->destructor;
+		skb->destructor = smsc95xx_tx_destructor;
+	}
+	netdev_sent_queue(dev->net, skb->len);
 
 	return skb;
 }
@@ -2217,7 +4260,8 @@ static const struct driver_info smsc95xx_info = {
 	.tx_fixup	= smsc95xx_tx_fixup,
 	.status		= smsc95xx_status,
 	.manage_power	= smsc95xx_manage_power,
-	.flags		= FLAG_ETHER | FLAG_SEND_ZLP | FLAG_LINK_INTR,
+	.flags		= FLAG_ETHER | FLAG_SEND_ZLP | FLAG_LINK_INTR |
+			  FLAG_MULTI_PACKET,
 };
 
 static const struct usb_device_id products[] = {
@@ -2325,6 +4369,8 @@ static struct usb_driver smsc95xx_driver = {
 	.disconnect	= usbnet_disconnect,
 	.disable_hub_initiated_lpm = 1,
 	.supports_autosuspend = 1,
+	/* bind defers hardware init, let adapters probe in parallel */
+	.drvwrap.driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 };
 
 module_usb_driver(smsc95xx_driver);
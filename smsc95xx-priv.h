@@ -12,6 +12,135 @@
 #include <linux/mii.h>
 #include <linux/usb.h>
 #include <linux/usb/usbnet.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/mutex.h>
+
+/* Pages recycled once the stack has released every fragment carved from
+ * them, i.e. when the pool holds the only reference left.
+ */
+struct smsc95xx_page_pool {
+	struct page **pages;
+	unsigned int count;
+	unsigned int next;
+	struct page *cur;
+	unsigned int offset;
+};
+
+#define SMSC95XX_RX_DESC_MAX	(64)
+
+/* one good frame found by the Rx status word pre-scan */
+struct smsc95xx_rx_desc {
+	u32 header;
+	u32 offset;
+	u16 size;
+};
+
+#define SMSC95XX_REG_BATCH_MAX	(16)
+
+/* one queued register access, data is where a read lands (NULL: write) */
+struct smsc95xx_reg_op {
+	u32 index;
+	u32 value;
+	u32 *data;
+};
+
+/* register accesses submitted back to back as async control URBs */
+struct smsc95xx_reg_batch {
+	struct usbnet *dev;
+	int in_pm;
+	int count;
+	int error;
+	struct smsc95xx_reg_op ops[SMSC95XX_REG_BATCH_MAX];
+};
+
+/* configuration registers served from a shadow copy */
+enum {
+	SMSC95XX_SHADOW_HW_CFG,
+	SMSC95XX_SHADOW_COE_CR,
+	SMSC95XX_SHADOW_INT_EP_CTL,
+	SMSC95XX_SHADOW_AFC_CFG,
+	SMSC95XX_SHADOW_WUCSR,
+	SMSC95XX_SHADOW_PM_CTRL,
+	SMSC95XX_SHADOW_NUM,
+};
+
+struct smsc95xx_shadow {
+	unsigned long valid;
+	u32 val[SMSC95XX_SHADOW_NUM];
+};
+
+#define SMSC95XX_CTRL_POOL_SIZE	(8)
+
+/* setup packet and register value of one control transfer; the value
+ * is DMA'd from the device and sits alone in its cache line */
+struct smsc95xx_ctrl_buf {
+	struct usb_ctrlrequest req;
+	u32 data ____cacheline_aligned;
+};
+
+struct smsc95xx_priv;
+
+/* preallocated control URB used for register access */
+struct smsc95xx_ctrl {
+	struct urb *urb;
+	struct smsc95xx_ctrl_buf *buf;
+	struct completion done;
+	struct smsc95xx_priv *pdata;
+	int slot;
+};
+
+/* driver counters exported through ethtool -S */
+struct smsc95xx_stats {
+	unsigned long rx_pool_hits;
+	unsigned long rx_pool_misses;
+	unsigned long rx_pool_high_water;
+	unsigned long rx_pool_pages;
+	unsigned long rx_urbs;
+	unsigned long rx_urb_frames;
+	unsigned long rx_urb_frames_max;
+	unsigned long rx_urb_bytes;
+	unsigned long rx_tune_changes;
+	unsigned long rx_bulk_in_dly;
+	unsigned long rx_burst_cap;
+	unsigned long rx_resyncs;
+	unsigned long rx_resync_salvaged;
+	unsigned long rx_bad_headers;
+	unsigned long rx_thread_drops;
+	unsigned long tx_agg_urbs;
+	unsigned long tx_agg_frames;
+	unsigned long tx_agg_frames_max;
+	unsigned long tx_linearized;
+	unsigned long tx_gso_skbs;
+	unsigned long tx_realloc;
+	unsigned long tx_prio_frames;
+	unsigned long tx_bulk_throttled;
+	unsigned long tx_pool_hits;
+	unsigned long tx_pool_misses;
+	unsigned long tx_pool_high_water;
+	unsigned long tx_alloc_fail;
+	unsigned long tx_done_batches;
+	unsigned long tx_done_urbs;
+	unsigned long tx_zlp_avoided;
+	unsigned long reg_shadow_hits;
+	unsigned long reset_lite_us;
+	unsigned long reset_phy_us;
+	unsigned long reset_bmcr_us;
+	unsigned long reset_total_us;
+	unsigned long ctrl_pool_exhausted;
+};
+
+/* adaptive BULK_IN_DLY/BURST_CAP controller state */
+struct smsc95xx_rx_tune {
+	struct delayed_work work;
+	int level;
+	/* bytes one burst can carry with the BURST_CAP of this level */
+	u32 burst_bytes;
+	/* counter snapshots from the previous run */
+	unsigned long urbs;
+	unsigned long frames;
+	unsigned long bytes;
+};
 
 struct smsc95xx_priv {
 	u32 chip_id;
@@ -25,7 +154,46 @@ struct smsc95xx_priv {
 	u8 mdix_ctrl;
 	bool link_ok;
 	struct delayed_work carrier_check;
+	/* hardware init deferred from bind, init_ret is its result */
+	struct work_struct init_work;
+	int init_ret;
+	/* set while init_work is queued, Rx mode changes are replayed after */
+	bool init_pending;
+	bool rx_mode_pending;
 	struct usbnet *dev;
+	struct smsc95xx_page_pool rx_pool;
+	struct smsc95xx_page_pool tx_pool;
+	struct napi_struct napi;
+	u32 burst_cap_max;
+	u32 burst_cap_min;
+	struct smsc95xx_rx_tune rx_tune;
+	struct task_struct *rx_thread;
+	struct sk_buff_head rx_thread_q;
+	/* held by rx_thread while it works on dequeued URBs */
+	struct mutex rx_thread_lock;
+	/* only used from rx_fixup, which usbnet never runs concurrently,
+	 * or from rx_thread when that one is running */
+	struct smsc95xx_rx_desc rx_desc[SMSC95XX_RX_DESC_MAX];
+	struct sk_buff_head rx_napi_q;
+	/* Tx aggregate being filled, protected by the netdev tx lock */
+	struct sk_buff *tx_agg;
+	u32 tx_agg_frames;
+	u32 tx_agg_payload;
+	/* offset of the last frame's command words in tx_agg */
+	u32 tx_agg_last;
+	struct hrtimer tx_agg_timer;
+	struct tasklet_struct tx_agg_bh;
+	/* frames packed into tx_agg, freed once its URB has completed */
+	struct sk_buff *tx_agg_held;
+	/* completed URBs not yet reported to BQL and the skbs they held,
+	 * all protected by the tx_done_q lock */
+	struct sk_buff_head tx_done_q;
+	u32 tx_done_pkts;
+	u32 tx_done_bytes;
+	struct smsc95xx_shadow shadow;
+	struct smsc95xx_ctrl ctrl[SMSC95XX_CTRL_POOL_SIZE];
+	unsigned long ctrl_busy;
+	struct smsc95xx_stats stats;
 #if defined(NETRW_DRV)
   struct netrw_priv *netrw_priv;
 #endif